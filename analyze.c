@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+
+#include "analyze.h"
+
+/* luma is sampled every SAMPLE_STEP pixels in both directions */
+#define SAMPLE_STEP 4
+#define SCENE_CHANGE_THRESHOLD 40.0
+
+typedef struct AnalyzeState {
+    uint8_t *prev;
+    uint8_t *cur;
+    int sw, sh;
+    double spatial_sum;
+    double temporal_sum;
+    int temporal_count;
+    double segment_sum;
+    int segment_count;
+    double segment_start;
+} AnalyzeState;
+
+static int is_planar_8bit_yuv(enum AVPixelFormat fmt) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL))
+        && desc->comp[0].depth == 8 && desc->comp[0].step == 1;
+}
+
+static void finish_segment(AnalyzeState *st, ComplexityStats *stats) {
+    if (st->segment_count > 0)
+        stats->peak_temporal = FFMAX(stats->peak_temporal, st->segment_sum / st->segment_count);
+    st->segment_sum = 0;
+    st->segment_count = 0;
+}
+
+/** Subsample the luma plane, then measure gradients and change against the previous sample. */
+static void analyze_frame(AnalyzeState *st, const AVFrame *frame, double t, ComplexityStats *stats) {
+    int x, y, w = frame->width / SAMPLE_STEP, h = frame->height / SAMPLE_STEP;
+    int64_t grad = 0, diff = 0;
+    uint8_t *tmp;
+    double temporal;
+
+    if (w < 2 || h < 2)
+        return;
+    if (w != st->sw || h != st->sh) {
+        av_freep(&st->prev);
+        av_freep(&st->cur);
+        st->prev = av_malloc(w * h);
+        st->cur = av_malloc(w * h);
+        st->sw = st->prev && st->cur ? w : 0;
+        st->sh = h;
+        if (!st->sw)
+            return;
+        st->temporal_count = -1; /* no previous sample at this size */
+    }
+
+    for (y = 0; y < h; y++) {
+        const uint8_t *src = frame->data[0] + (int64_t)y * SAMPLE_STEP * frame->linesize[0];
+        for (x = 0; x < w; x++)
+            st->cur[y * w + x] = src[x * SAMPLE_STEP];
+    }
+    for (y = 0; y < h - 1; y++) {
+        for (x = 0; x < w - 1; x++) {
+            grad += abs(st->cur[y * w + x] - st->cur[y * w + x + 1])
+                + abs(st->cur[y * w + x] - st->cur[(y + 1) * w + x]);
+        }
+    }
+    st->spatial_sum += (double)grad / (2.0 * (w - 1) * (h - 1));
+    stats->frames++;
+
+    if (st->temporal_count >= 0) {
+        for (x = 0; x < w * h; x++)
+            diff += abs(st->cur[x] - st->prev[x]);
+        temporal = (double)diff / (w * h);
+        if (temporal > SCENE_CHANGE_THRESHOLD) {
+            stats->scene_changes++;
+        }else {
+            /* cuts say nothing about motion inside a shot */
+            st->temporal_sum += temporal;
+            st->temporal_count++;
+            st->segment_sum += temporal;
+            st->segment_count++;
+        }
+    }else {
+        st->temporal_count = 0;
+    }
+    if (t - st->segment_start >= ANALYZE_SEGMENT_SECONDS) {
+        finish_segment(st, stats);
+        st->segment_start = t;
+    }
+
+    tmp = st->prev;
+    st->prev = st->cur;
+    st->cur = tmp;
+}
+
+/**
+ * Complexity pass over the first max_seconds of the main video stream
+ * (0 = whole file). Non-reference frames and the loop filter are skipped, so
+ * this runs much faster than realtime.
+ */
+int analyze_complexity(const char *filename, double max_seconds, ComplexityStats *stats) {
+    AVFormatContext *ifmt_ctx = NULL;
+    AVCodecContext *dec_ctx = NULL;
+    AVCodec *dec = NULL;
+    AVStream *stream;
+    AVPacket packet = { .data = NULL, .size = 0 };
+    AVFrame *frame = NULL;
+    AnalyzeState st = { 0 };
+    double t = 0;
+    int ret, stream_index;
+
+    memset(stats, 0, sizeof(*stats));
+    if ((ret = avformat_open_input(&ifmt_ctx, filename, NULL, NULL)) < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(ifmt_ctx, NULL)) < 0)
+        goto end;
+    if ((ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0)) < 0)
+        goto end;
+    stream_index = ret;
+    stream = ifmt_ctx->streams[stream_index];
+
+    dec_ctx = avcodec_alloc_context3(dec);
+    frame = av_frame_alloc();
+    if (!dec_ctx || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(dec_ctx, stream->codecpar)) < 0)
+        goto end;
+    dec_ctx->skip_frame = AVDISCARD_NONREF;
+    dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+    dec_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+    dec_ctx->thread_count = 0;
+    if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0)
+        goto end;
+    if (!is_planar_8bit_yuv(dec_ctx->pix_fmt)) {
+        ret = AVERROR_PATCHWELCOME;
+        goto end;
+    }
+
+    while ((ret = av_read_frame(ifmt_ctx, &packet)) >= 0) {
+        if (packet.stream_index == stream_index)
+            ret = avcodec_send_packet(dec_ctx, &packet);
+        av_packet_unref(&packet);
+        if (ret < 0 && ret != AVERROR(EAGAIN))
+            continue;
+        while (avcodec_receive_frame(dec_ctx, frame) >= 0) {
+            int64_t pts = av_frame_get_best_effort_timestamp(frame);
+            if (pts != AV_NOPTS_VALUE)
+                t = (pts - (stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0)) * av_q2d(stream->time_base);
+            analyze_frame(&st, frame, t, stats);
+            av_frame_unref(frame);
+        }
+        if (max_seconds > 0 && t >= max_seconds)
+            break;
+    }
+    finish_segment(&st, stats);
+    if (stats->frames > 0)
+        stats->spatial = st.spatial_sum / stats->frames;
+    if (st.temporal_count > 0)
+        stats->temporal = st.temporal_sum / st.temporal_count;
+    stats->duration = t;
+    ret = stats->frames > 0 ? 0 : AVERROR_INVALIDDATA;
+
+end:
+    av_freep(&st.prev);
+    av_freep(&st.cur);
+    av_frame_free(&frame);
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&ifmt_ctx);
+    return ret;
+}
+
+/* "<file>.cx" keeps the result so further renditions of the file skip the pass */
+int analyze_load(const char *filename, ComplexityStats *stats) {
+    char path[512];
+    struct stat st;
+    long long size, mtime;
+    FILE *fp;
+    int ok;
+
+    if (stat(filename, &st) < 0)
+        return AVERROR(errno);
+    snprintf(path, sizeof(path), "%s%s", filename, ANALYZE_SUFFIX);
+    if ((fp = fopen(path, "r")) == NULL)
+        return AVERROR(errno);
+    ok = fscanf(fp, "cx1 %lld %lld %lf %lf %lf %d %d %lf", &size, &mtime,
+            &stats->spatial, &stats->temporal, &stats->peak_temporal,
+            &stats->scene_changes, &stats->frames, &stats->duration) == 8
+        && size == st.st_size && mtime == st.st_mtime;
+    fclose(fp);
+    return ok ? 0 : AVERROR_INVALIDDATA;
+}
+
+/* written under a per-thread temporary name, so concurrent sessions never see a partial file */
+int analyze_save(const char *filename, const ComplexityStats *stats) {
+    char path[512], tmp[560];
+    struct stat st;
+    FILE *fp;
+    int ok;
+
+    if (stat(filename, &st) < 0)
+        return AVERROR(errno);
+    snprintf(path, sizeof(path), "%s%s", filename, ANALYZE_SUFFIX);
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lx.tmp", path, (int)getpid(), (unsigned long)pthread_self());
+    if ((fp = fopen(tmp, "w")) == NULL)
+        return AVERROR(errno);
+    fprintf(fp, "cx1 %lld %lld %f %f %f %d %d %f\n", (long long)st.st_size, (long long)st.st_mtime,
+        stats->spatial, stats->temporal, stats->peak_temporal,
+        stats->scene_changes, stats->frames, stats->duration);
+    ok = fclose(fp) == 0;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+/**
+ * Per-title rate control: CRF from the average complexity, with a VBV cap
+ * scaled by the busiest segment so high-motion parts may exceed the target
+ * bitrate and static content settles well below it.
+ */
+void analyze_choose_rate(const ComplexityStats *stats, int target_bitrate, RateChoice *choice) {
+    double c, scale;
+
+    /* 1.0 is roughly a typical film/talking head source at 4 pixel sampling */
+    c = (stats->temporal + 1.0) / 4.0 * sqrt((stats->spatial + 1.0) / 12.0);
+    choice->crf = av_clipf(23.0 - 3.0 * log2(c), 19.0, 28.0);
+    scale = av_clipd(0.6 + stats->peak_temporal / 10.0, 0.6, 2.0);
+    choice->maxrate = (int)(target_bitrate * scale);
+    choice->bufsize = choice->maxrate * 2;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#ifndef _ANALYZE_H_
+#define _ANALYZE_H_
+
+#include <stdint.h>
+
+#define ANALYZE_SUFFIX ".cx"
+#define ANALYZE_SEGMENT_SECONDS 4.0
+
+typedef struct ComplexityStats {
+    double spatial;         /* mean absolute luma gradient, 0-255 */
+    double temporal;        /* mean absolute luma change between sampled frames, 0-255 */
+    double peak_temporal;   /* highest per-segment temporal complexity */
+    int scene_changes;
+    int frames;
+    double duration;        /* seconds analysed */
+} ComplexityStats;
+
+typedef struct RateChoice {
+    float crf;
+    int maxrate;            /* bit/s */
+    int bufsize;            /* bits */
+} RateChoice;
+
+int analyze_complexity(const char *filename, double max_seconds, ComplexityStats *stats);
+int analyze_load(const char *filename, ComplexityStats *stats);
+int analyze_save(const char *filename, const ComplexityStats *stats);
+void analyze_choose_rate(const ComplexityStats *stats, int target_bitrate, RateChoice *choice);
+
+#endif
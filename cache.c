@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "ffmpeg.h"
+#include "log.h"
+
+/*
+ * Transcoded outputs on disk, named after a hash of (input, input mtime and
+ * size, encode parameters). Entries are kept in LRU order, most recent first;
+ * "<name>.<pid>.part" files are outputs still being written, flock()ed by
+ * their writer. Across a hot restart both processes write into the same
+ * directory: neither touches a ".part" file the other holds, and each picks
+ * up entries the other committed when a lookup misses its own index.
+ */
+
+/**
+ * An output still being transcoded. Later requests for the same key read
+ * the ".part" file from the start and then wait on the condition variable
+ * for the writer to append more, so one encoder serves every viewer.
+ */
+struct CacheWriter {
+    char key[CACHE_KEY_SIZE];
+    char path[512];             /* the ".part" file */
+    char target[512];           /* its name once complete */
+    int fd;
+    int64_t written;
+    int finished;       /* 1 = complete, -1 = failed */
+    int followers;
+    pid_t background;   /* idle priority transcode to speed up once followed, 0 = none */
+    pthread_cond_t cond;
+    struct CacheWriter *next;
+};
+
+static char cache_dir[400];
+static int64_t cache_max_bytes = 0;
+static int64_t cache_total_bytes = 0;
+static CacheEntry *lru_head = NULL;
+static CacheEntry *lru_tail = NULL;
+static CacheWriter *writers = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lru_unlink(CacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(CacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head)
+        lru_head->prev = entry;
+    lru_head = entry;
+    if (lru_tail == NULL)
+        lru_tail = entry;
+}
+
+/** Insert keeping the list ordered by last_access, used while loading the directory. */
+static void lru_insert_sorted(CacheEntry *entry)
+{
+    CacheEntry *pos = lru_head;
+
+    while (pos != NULL && pos->last_access > entry->last_access)
+        pos = pos->next;
+    if (pos == NULL) {
+        entry->prev = lru_tail;
+        entry->next = NULL;
+        if (lru_tail)
+            lru_tail->next = entry;
+        else
+            lru_head = entry;
+        lru_tail = entry;
+    }else {
+        entry->next = pos;
+        entry->prev = pos->prev;
+        if (pos->prev)
+            pos->prev->next = entry;
+        else
+            lru_head = entry;
+        pos->prev = entry;
+    }
+}
+
+/** Drop least recently used entries nobody is reading until we fit the budget. */
+static void evict_locked()
+{
+    CacheEntry *entry = lru_tail;
+    CacheEntry *prev;
+
+    while (cache_total_bytes > cache_max_bytes && entry != NULL) {
+        prev = entry->prev;
+        if (entry->refcount == 0) {
+            unlink(entry->path);
+            cache_total_bytes -= entry->size;
+            lru_unlink(entry);
+            INFO_LOG("cache: evicted %s (%lld bytes)\n", entry->key, (long long)entry->size);
+            free(entry);
+        }
+        entry = prev;
+    }
+}
+
+static CacheEntry *new_entry(const char *name, const char *path, const struct stat *st)
+{
+    CacheEntry *entry = calloc(1, sizeof(*entry));
+
+    if (entry == NULL)
+        return NULL;
+    snprintf(entry->key, sizeof(entry->key), "%.16s", name);
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->size = st->st_size;
+    entry->last_access = st->st_mtime;
+    return entry;
+}
+
+int cache_init(const char *dir, int64_t max_bytes)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    char path[512];
+    CacheEntry *entry;
+    size_t len;
+    int fd;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    d = opendir(dir);
+    if (d == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    cache_max_bytes = max_bytes;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        len = strlen(de->d_name);
+        if (len > 5 && strcmp(de->d_name + len - 5, ".part") == 0) {
+            /* left over from a transcode that never finished, unless its writer still holds it */
+            if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+                if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+                    unlink(path);
+                close(fd);
+            }
+            continue;
+        }
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || len < CACHE_KEY_SIZE - 1)
+            continue;
+        if ((entry = new_entry(de->d_name, path, &st)) == NULL)
+            continue;
+        lru_insert_sorted(entry);
+        cache_total_bytes += entry->size;
+    }
+    closedir(d);
+    evict_locked();
+    INFO_LOG("cache: %s, %lld of %lld bytes used\n", dir,
+        (long long)cache_total_bytes, (long long)cache_max_bytes);
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+int cache_enabled()
+{
+    return cache_dir[0] != '\0';
+}
+
+/** Hash the input identity and encode parameters into a 16 hex digit key. */
+void cache_make_key(const char *input, const char *params, char *key)
+{
+    char buf[1024];
+    struct stat st;
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char *p;
+
+    memset(&st, 0, sizeof(st));
+    stat(input, &st);
+    snprintf(buf, sizeof(buf), "%s|%lld|%lld|%s", input,
+        (long long)st.st_mtime, (long long)st.st_size, params);
+    for (p = (const unsigned char *)buf; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    snprintf(key, CACHE_KEY_SIZE, "%016llx", (unsigned long long)h);
+}
+
+static CacheEntry *lookup_locked(const char *key)
+{
+    CacheEntry *entry;
+
+    for (entry = lru_head; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0)
+            break;
+    }
+    if (entry != NULL) {
+        entry->refcount++;
+        entry->last_access = time(NULL);
+        lru_unlink(entry);
+        lru_push_front(entry);
+        /* mtime carries the LRU order across restarts */
+        utimensat(AT_FDCWD, entry->path, NULL, 0);
+    }
+    return entry;
+}
+
+void cache_release(CacheEntry *entry)
+{
+    pthread_mutex_lock(&cache_lock);
+    entry->refcount--;
+    evict_locked();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void writer_free_locked(CacheWriter *writer)
+{
+    CacheWriter **link;
+
+    for (link = &writers; *link != NULL; link = &(*link)->next) {
+        if (*link == writer) {
+            *link = writer->next;
+            break;
+        }
+    }
+    pthread_cond_destroy(&writer->cond);
+    free(writer);
+}
+
+/** Index an output the other process of a hot restart committed after we loaded the directory. */
+static CacheEntry *adopt_locked(const char *key, const char *extension)
+{
+    char path[512];
+    struct stat st;
+    CacheEntry *entry;
+
+    snprintf(path, sizeof(path), "%s/%s.%s", cache_dir, key, extension);
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || (entry = new_entry(key, path, &st)) == NULL)
+        return NULL;
+    entry->refcount = 1;
+    entry->last_access = time(NULL);
+    lru_push_front(entry);
+    cache_total_bytes += entry->size;
+    evict_locked();
+    INFO_LOG("cache: picked up %s\n", path);
+    return entry;
+}
+
+/** Create the ".part" file a new transcode is teed into. */
+static CacheWriter *begin_locked(const char *key, const char *extension)
+{
+    CacheWriter *writer;
+
+    writer = calloc(1, sizeof(*writer));
+    if (writer == NULL)
+        return NULL;
+    snprintf(writer->key, sizeof(writer->key), "%s", key);
+    snprintf(writer->target, sizeof(writer->target), "%s/%s.%s", cache_dir, key, extension);
+    snprintf(writer->path, sizeof(writer->path), "%s.%d.part", writer->target, (int)getpid());
+    writer->fd = open(writer->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        free(writer);
+        return NULL;
+    }
+    /* tells a process started by a hot restart that this one is still being written */
+    flock(writer->fd, LOCK_EX | LOCK_NB);
+    pthread_cond_init(&writer->cond, NULL);
+    writer->next = writers;
+    writers = writer;
+    return writer;
+}
+
+int cache_write(CacheWriter *writer, const char *buf, int size)
+{
+    ssize_t n;
+    int done = 0;
+
+    while (done < size) {
+        n = write(writer->fd, buf + done, size - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    writer->written += size;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/** Publish a finished output (the muxer wrote its trailer) or discard it. */
+void cache_commit(CacheWriter *writer, int complete)
+{
+    struct stat st;
+    CacheEntry *entry;
+    int fd = writer->fd;
+
+    pthread_mutex_lock(&cache_lock);
+    for (entry = lru_head; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->key, writer->key) == 0)
+            break;
+    }
+    /* followers keep their open descriptor across the rename */
+    if (!complete || entry != NULL || rename(writer->path, writer->target) < 0 || stat(writer->target, &st) < 0) {
+        /* an entry already there came from the other process of a hot restart */
+        unlink(writer->path);
+        writer->finished = complete && entry != NULL ? 1 : -1;
+    }else {
+        writer->finished = 1;
+        if ((entry = new_entry(writer->key, writer->target, &st)) != NULL) {
+            entry->last_access = time(NULL);
+            lru_push_front(entry);
+            cache_total_bytes += entry->size;
+            evict_locked();
+        }
+    }
+    pthread_cond_broadcast(&writer->cond);
+    if (writer->followers == 0)
+        writer_free_locked(writer);
+    pthread_mutex_unlock(&cache_lock);
+    /* after the rename, so a restarted process never sees the ".part" file unlocked */
+    close(fd);
+}
+
+/** Attach to an output being written. Returns NULL if there is none. */
+static CacheWriter *follow_locked(const char *key, int *fd)
+{
+    CacheWriter *writer;
+
+    for (writer = writers; writer != NULL; writer = writer->next) {
+        if (writer->finished == 0 && strcmp(writer->key, key) == 0)
+            break;
+    }
+    if (writer != NULL) {
+        /* opened under the lock, before cache_commit can rename it */
+        *fd = open(writer->path, O_RDONLY | O_CLOEXEC);
+        if (*fd < 0)
+            writer = NULL;
+        else
+            writer->followers++;
+    }
+    return writer;
+}
+
+/**
+ * Find out, in one step, what a request for key should do:
+ *  CACHE_HIT     serve *entry, then cache_release() it;
+ *  CACHE_FOLLOW  tail *writer through *fd, then close it and cache_unfollow();
+ *  CACHE_MISS    transcode, teeing into *writer (NULL if the ".part" file
+ *                could not be created, or the output is being written at
+ *                an idle priority that cannot be raised) and cache_commit()
+ *                it at the end.
+ * Doing all three under one hold of the lock keeps two first requests for
+ * the same rendition from both starting an encoder. A viewer (background
+ * = 0) following a background transcode raises it to normal priority.
+ */
+enum cache_open_enum cache_open(const char *key, const char *extension, int background,
+    CacheEntry **entry, CacheWriter **writer, int *fd)
+{
+    enum cache_open_enum ret;
+
+    pthread_mutex_lock(&cache_lock);
+    if ((*entry = lookup_locked(key)) != NULL || (*entry = adopt_locked(key, extension)) != NULL) {
+        ret = CACHE_HIT;
+    }else if ((*writer = follow_locked(key, fd)) != NULL) {
+        ret = CACHE_FOLLOW;
+        /* a viewer must not wait on a transcode that only gets idle time */
+        if (!background && (*writer)->background > 0) {
+            if (set_trans_task_priority((*writer)->background, 0) == 0) {
+                (*writer)->background = 0;
+            }else {
+                WARNING_LOG("cache: cannot raise the background transcode of %s, transcoding again\n", key);
+                close(*fd);
+                (*writer)->followers--;
+                *writer = NULL;
+                ret = CACHE_MISS;
+            }
+        }
+    }else {
+        *writer = begin_locked(key, extension);
+        ret = CACHE_MISS;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return ret;
+}
+
+/**
+ * Mark the writer as fed by a background transcode running as pid, which
+ * cache_open() raises to normal priority when a viewer follows it. Reset
+ * to 0 before reaping the process.
+ */
+void cache_set_background(CacheWriter *writer, pid_t pid)
+{
+    pthread_mutex_lock(&cache_lock);
+    writer->background = pid;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Wait until the writer has more than offset bytes. Returns the number of
+ * bytes available past offset, 0 once a complete output has been read to
+ * the end, or -1 if the transcode failed.
+ */
+int64_t cache_wait(CacheWriter *writer, int64_t offset)
+{
+    int64_t available;
+
+    pthread_mutex_lock(&cache_lock);
+    while (writer->written <= offset && writer->finished == 0)
+        pthread_cond_wait(&writer->cond, &cache_lock);
+    available = writer->written - offset;
+    if (available <= 0)
+        available = writer->finished > 0 ? 0 : -1;
+    pthread_mutex_unlock(&cache_lock);
+
+    return available;
+}
+
+void cache_unfollow(CacheWriter *writer)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (--writer->followers == 0 && writer->finished != 0)
+        writer_free_locked(writer);
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CACHE_KEY_SIZE 17
+
+enum cache_open_enum
+{
+    CACHE_MISS = 0,         /* nobody has it: transcode and write it */
+    CACHE_HIT,              /* complete on disk */
+    CACHE_FOLLOW,           /* another request is writing it */
+};
+
+typedef struct CacheEntry {
+    char key[CACHE_KEY_SIZE];
+    char path[512];
+    int64_t size;
+    int64_t last_access;
+    int refcount;
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+} CacheEntry;
+
+int cache_init(const char *dir, int64_t max_bytes);
+int cache_enabled();
+void cache_make_key(const char *input, const char *params, char *key);
+typedef struct CacheWriter CacheWriter;
+
+enum cache_open_enum cache_open(const char *key, const char *extension, int background,
+    CacheEntry **entry, CacheWriter **writer, int *fd);
+void cache_release(CacheEntry *entry);
+int cache_write(CacheWriter *writer, const char *buf, int size);
+void cache_commit(CacheWriter *writer, int complete);
+void cache_set_background(CacheWriter *writer, pid_t pid);
+int64_t cache_wait(CacheWriter *writer, int64_t offset);
+void cache_unfollow(CacheWriter *writer);
+
+#endif
@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "cluster.h"
+#include "server.h"
+#include "log.h"
+
+#define BLOCK_SIZE 4096
+#define FRAME_HEADER_SIZE 5
+
+/*
+ * Worker protocol. The coordinator opens one TCP connection per task and
+ * sends a single line:
+ *
+ *     TASK <start> <end> <url> <query or ->\n
+ *
+ * The worker answers with frames of a type byte and a big-endian 32 bit
+ * payload length: 'D' output bytes, 'H' heartbeat (empty, sent after a
+ * second without output), 'E' end of task ("0" when the transcode
+ * succeeded). A worker that sends nothing for CLUSTER_WORKER_TIMEOUT
+ * seconds, or drops the connection before 'E', is lost.
+ */
+#define FRAME_DATA 'D'
+#define FRAME_HEARTBEAT 'H'
+#define FRAME_END 'E'
+
+typedef struct ClusterWorker {
+    char host[128];
+    char port[8];
+    int busy;                   /* runs a task for us */
+    time_t down_until;          /* lost: no tasks before then */
+} ClusterWorker;
+
+enum chunk_state_enum
+{
+    CHUNK_PENDING = 0,
+    CHUNK_RUNNING,
+    CHUNK_DONE,
+    CHUNK_FAILED,
+};
+
+typedef struct ClusterChunk {
+    struct ClusterRun *run;
+    const ClusterTask *task;
+    ClusterWorker *worker;
+    enum chunk_state_enum state;
+    int attempts;
+    int emitted;                /* output already went out, a retry would repeat it */
+    int sock;                   /* connection to the worker while running, -1 otherwise */
+    char *data;                 /* output not yet written to the pipe */
+    size_t size;
+    size_t capacity;
+} ClusterChunk;
+
+struct ClusterRun {
+    ClusterTask *tasks;
+    ClusterChunk *chunks;
+    int nb_tasks;
+    int fd;                     /* write end of the output pipe */
+    int aborted;
+    int running;                /* chunk threads still alive */
+    int result;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static ClusterWorker workers[CLUSTER_MAX_WORKERS];
+static int nb_workers = 0;
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int write_all(int fd, const void *buf, size_t size, int flags)
+{
+    const char *p = buf;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = flags >= 0 ? send(fd, p, size, flags) : write(fd, p, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+/* fails on error, end of stream and the receive timeout alike */
+static int read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = recv(fd, p, size, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static int send_frame(int sock, char type, const void *payload, uint32_t size)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    header[0] = type;
+    header[1] = size >> 24;
+    header[2] = size >> 16;
+    header[3] = size >> 8;
+    header[4] = size;
+    if (write_all(sock, header, sizeof(header), MSG_NOSIGNAL) < 0)
+        return -1;
+    return size > 0 ? write_all(sock, payload, size, MSG_NOSIGNAL) : 0;
+}
+
+/** Add workers from a comma separated list of host:port. */
+int cluster_add_workers(const char *addresses)
+{
+    const char *p = addresses, *end, *colon;
+    ClusterWorker *worker;
+    size_t len;
+
+    while (*p != '\0') {
+        end = p + strcspn(p, ",");
+        colon = memchr(p, ':', end - p);
+        len = colon ? (size_t)(colon - p) : 0;
+        if (nb_workers >= CLUSTER_MAX_WORKERS || len == 0 || len >= sizeof(worker->host)
+            || end - colon - 1 <= 0 || (size_t)(end - colon - 1) >= sizeof(worker->port))
+            return -1;
+        worker = &workers[nb_workers++];
+        memcpy(worker->host, p, len);
+        worker->host[len] = '\0';
+        memcpy(worker->port, colon + 1, end - colon - 1);
+        worker->port[end - colon - 1] = '\0';
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+int cluster_enabled()
+{
+    return nb_workers > 0;
+}
+
+int cluster_workers()
+{
+    return nb_workers;
+}
+
+static ClusterWorker *take_worker()
+{
+    ClusterWorker *worker = NULL;
+    time_t now = time(NULL);
+    int i;
+
+    pthread_mutex_lock(&workers_lock);
+    for (i = 0; i < nb_workers; i++) {
+        if (!workers[i].busy && workers[i].down_until <= now) {
+            worker = &workers[i];
+            worker->busy = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&workers_lock);
+    return worker;
+}
+
+static void release_worker(ClusterWorker *worker, int lost)
+{
+    pthread_mutex_lock(&workers_lock);
+    worker->busy = 0;
+    if (lost)
+        worker->down_until = time(NULL) + CLUSTER_WORKER_BACKOFF;
+    pthread_mutex_unlock(&workers_lock);
+}
+
+static int connect_worker(const ClusterWorker *worker)
+{
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = { .tv_sec = CLUSTER_WORKER_TIMEOUT };
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(worker->host, worker->port, &hints, &res) != 0)
+        return -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sock < 0)
+            continue;
+        /* also bounds connect() */
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+/* the caller holds run->lock */
+static int chunk_append(ClusterChunk *chunk, const char *buf, size_t size)
+{
+    size_t capacity = chunk->capacity ? chunk->capacity : 64 * 1024;
+    char *data;
+
+    while (chunk->size + size > capacity)
+        capacity *= 2;
+    if (capacity != chunk->capacity) {
+        data = realloc(chunk->data, capacity);
+        if (data == NULL)
+            return -1;
+        chunk->data = data;
+        chunk->capacity = capacity;
+    }
+    memcpy(chunk->data + chunk->size, buf, size);
+    chunk->size += size;
+    return 0;
+}
+
+/**
+ * Run one chunk on its worker, collecting the output. Returns 0 when the
+ * worker finished it, 1 when the transcode failed there, -1 when the
+ * worker was lost.
+ */
+static int run_chunk(ClusterChunk *chunk)
+{
+    ClusterRun *run = chunk->run;
+    const ClusterTask *task = chunk->task;
+    unsigned char header[FRAME_HEADER_SIZE];
+    char line[1024], buf[BLOCK_SIZE];
+    uint32_t size, n;
+    int sock, ret;
+
+    if ((sock = connect_worker(chunk->worker)) < 0)
+        return -1;
+    pthread_mutex_lock(&run->lock);
+    chunk->sock = sock;
+    if (run->aborted)
+        shutdown(sock, SHUT_RDWR);
+    pthread_mutex_unlock(&run->lock);
+
+    snprintf(line, sizeof(line), "TASK %.6f %.6f %s %s\n", task->start_time, task->end_time,
+        task->url, task->query[0] ? task->query : "-");
+    ret = -1;
+    if (write_all(sock, line, strlen(line), MSG_NOSIGNAL) < 0)
+        goto end;
+    while (read_all(sock, header, sizeof(header)) == 0) {
+        size = (uint32_t)header[1] << 24 | header[2] << 16 | header[3] << 8 | header[4];
+        if (header[0] == FRAME_END) {
+            if (size == 0 || size >= sizeof(buf) || read_all(sock, buf, size) < 0)
+                break;
+            buf[size] = '\0';
+            ret = atoi(buf) == 0 ? 0 : 1;
+            break;
+        }
+        for (; size > 0; size -= n) {
+            n = size < sizeof(buf) ? size : sizeof(buf);
+            if (read_all(sock, buf, n) < 0)
+                goto end;
+            pthread_mutex_lock(&run->lock);
+            if (header[0] == FRAME_DATA && chunk_append(chunk, buf, n) < 0)
+                run->aborted = 1;
+            pthread_cond_broadcast(&run->cond);
+            pthread_mutex_unlock(&run->lock);
+        }
+    }
+
+end:
+    pthread_mutex_lock(&run->lock);
+    chunk->sock = -1;
+    pthread_mutex_unlock(&run->lock);
+    close(sock);
+    return ret;
+}
+
+static void *chunk_thread(void *arg)
+{
+    ClusterChunk *chunk = arg;
+    ClusterRun *run = chunk->run;
+    int ret;
+
+    ret = run_chunk(chunk);
+
+    pthread_mutex_lock(&run->lock);
+    if (ret < 0 && !run->aborted)
+        WARNING_LOG("worker %s:%s lost during %s %0.3f-%0.3fs\n", chunk->worker->host,
+            chunk->worker->port, chunk->task->url, chunk->task->start_time, chunk->task->end_time);
+    release_worker(chunk->worker, ret < 0 && !run->aborted);
+    chunk->worker = NULL;
+    if (ret == 0) {
+        chunk->state = CHUNK_DONE;
+    }else if (ret < 0 && !chunk->emitted && chunk->attempts < CLUSTER_MAX_ATTEMPTS) {
+        /* nothing of it went out yet: start over on another worker */
+        chunk->state = CHUNK_PENDING;
+        chunk->size = 0;
+    }else {
+        chunk->state = CHUNK_FAILED;
+    }
+    run->running--;
+    pthread_cond_broadcast(&run->cond);
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+/* start pending chunks in the window after head on free workers; the caller holds run->lock */
+static void dispatch(ClusterRun *run, int head)
+{
+    int i, window = head + 2 * nb_workers;
+    ClusterChunk *chunk;
+    ClusterWorker *worker;
+    pthread_t thread;
+
+    for (i = head; i < window && i < run->nb_tasks; i++) {
+        chunk = &run->chunks[i];
+        if (chunk->state != CHUNK_PENDING)
+            continue;
+        if ((worker = take_worker()) == NULL)
+            return;
+        chunk->worker = worker;
+        chunk->state = CHUNK_RUNNING;
+        chunk->attempts++;
+        if (pthread_create(&thread, NULL, chunk_thread, chunk) != 0) {
+            release_worker(worker, 0);
+            chunk->state = CHUNK_FAILED;
+            return;
+        }
+        pthread_detach(thread);
+        run->running++;
+        DEBUG_LOG("chunk %d (%0.3f-%0.3fs) to %s:%s, attempt %d\n", i, chunk->task->start_time,
+            chunk->task->end_time, worker->host, worker->port, chunk->attempts);
+    }
+}
+
+/**
+ * Coordinator: keep the workers busy on the chunks after the one being
+ * written, and write the output in task order. The chunk at the head is
+ * passed through as it arrives; later ones are held until it completes.
+ */
+static void *run_thread(void *arg)
+{
+    ClusterRun *run = arg;
+    ClusterChunk *chunk;
+    struct timespec deadline;
+    char *data;
+    size_t size;
+    int head = 0, i, ret;
+
+    pthread_mutex_lock(&run->lock);
+    while (head < run->nb_tasks && !run->aborted) {
+        dispatch(run, head);
+        chunk = &run->chunks[head];
+        if (chunk->size > 0) {
+            data = chunk->data;
+            size = chunk->size;
+            chunk->data = NULL;
+            chunk->size = chunk->capacity = 0;
+            chunk->emitted = 1;
+            pthread_mutex_unlock(&run->lock);
+            ret = write_all(run->fd, data, size, -1);
+            free(data);
+            pthread_mutex_lock(&run->lock);
+            /* the reader went away */
+            if (ret < 0)
+                run->aborted = 1;
+        }else if (chunk->state == CHUNK_DONE) {
+            head++;
+        }else if (chunk->state == CHUNK_FAILED) {
+            ERROR_LOG("%s %0.3f-%0.3fs failed after %d attempt(s)\n", chunk->task->url,
+                chunk->task->start_time, chunk->task->end_time, chunk->attempts);
+            run->aborted = 1;
+        }else {
+            /* wake up now and then for workers coming back from their backoff */
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&run->cond, &run->lock, &deadline);
+        }
+    }
+    run->result = head < run->nb_tasks ? -1 : 0;
+    run->aborted = 1;
+    close(run->fd);
+    /* unblock the chunks still running, then wait for them to let go of run */
+    for (i = 0; i < run->nb_tasks; i++) {
+        if (run->chunks[i].sock >= 0)
+            shutdown(run->chunks[i].sock, SHUT_RDWR);
+    }
+    while (run->running > 0)
+        pthread_cond_wait(&run->cond, &run->lock);
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+/**
+ * Run tasks on the workers, in parallel, and return the read end of a pipe
+ * carrying their output in order, like spawn_trans_task. Takes ownership of
+ * tasks. Collect the result with cluster_finish() after closing the pipe.
+ */
+int cluster_start(ClusterTask *tasks, int nb_tasks, ClusterRun **prun)
+{
+    ClusterRun *run;
+    int pfds[2];
+    int i;
+
+    run = calloc(1, sizeof(*run));
+    if (run == NULL || (run->chunks = calloc(nb_tasks, sizeof(*run->chunks))) == NULL) {
+        free(run);
+        free(tasks);
+        return -1;
+    }
+    if (pipe(pfds) < 0) {
+        free(run->chunks);
+        free(run);
+        free(tasks);
+        return -1;
+    }
+    run->tasks = tasks;
+    run->nb_tasks = nb_tasks;
+    run->fd = pfds[1];
+    for (i = 0; i < nb_tasks; i++) {
+        run->chunks[i].run = run;
+        run->chunks[i].task = &tasks[i];
+        run->chunks[i].sock = -1;
+    }
+    pthread_mutex_init(&run->lock, NULL);
+    pthread_cond_init(&run->cond, NULL);
+    if (pthread_create(&run->thread, NULL, run_thread, run) != 0) {
+        close(pfds[0]);
+        close(pfds[1]);
+        run->result = -1;
+        cluster_finish(run);
+        return -1;
+    }
+    *prun = run;
+    return pfds[0];
+}
+
+/** Wait for a run to end; returns 0 when every task completed. */
+int cluster_finish(ClusterRun *run)
+{
+    int i, ret;
+
+    if (run->thread)
+        pthread_join(run->thread, NULL);
+    ret = run->result;
+    for (i = 0; i < run->nb_tasks; i++)
+        free(run->chunks[i].data);
+    pthread_mutex_destroy(&run->lock);
+    pthread_cond_destroy(&run->cond);
+    free(run->chunks);
+    free(run->tasks);
+    free(run);
+    return ret;
+}
+
+typedef struct WorkerSession {
+    int client;
+    cluster_spawner spawner;
+} WorkerSession;
+
+/* worker side of one task: stream the transcode back in frames */
+static void *worker_session(void *arg)
+{
+    WorkerSession *session = arg;
+    int client = session->client;
+    static int task_counter = 0;
+    struct pollfd pfd;
+    ClusterTask task;
+    char line[1024], buf[BLOCK_SIZE];
+    int fd, ret = 0, status = 0, completed = 0, alive = 1;
+    pid_t pid;
+
+    log_set_tag("t%d", __atomic_add_fetch(&task_counter, 1, __ATOMIC_RELAXED));
+    memset(&task, 0, sizeof(task));
+    if (get_line(client, line, sizeof(line)) == 0
+        || sscanf(line, "TASK %lf %lf %254s %511s", &task.start_time, &task.end_time,
+            task.url, task.query) != 4) {
+        WARNING_LOG("bad task line: %s", line);
+        goto end;
+    }
+    if (strcmp(task.query, "-") == 0)
+        task.query[0] = '\0';
+    INFO_LOG("task %s?%s %0.3f-%0.3fs\n", task.url, task.query, task.start_time, task.end_time);
+
+    if ((fd = session->spawner(&task, &pid)) < 0) {
+        send_frame(client, FRAME_END, "1", 1);
+        goto end;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (alive) {
+        ret = poll(&pfd, 1, CLUSTER_HEARTBEAT_INTERVAL * 1000);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0) {
+            alive = send_frame(client, FRAME_HEARTBEAT, NULL, 0) == 0;
+            continue;
+        }
+        if ((ret = read(fd, buf, sizeof(buf))) <= 0)
+            break;
+        alive = send_frame(client, FRAME_DATA, buf, ret) == 0;
+    }
+    close(fd);
+    /* the coordinator gave up on this task */
+    if (!alive)
+        kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    completed = alive && ret == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (alive)
+        send_frame(client, FRAME_END, completed ? "0" : "1", 1);
+    INFO_LOG("task %s\n", completed ? "done" : "failed");
+
+end:
+    close(client);
+    free(session);
+    return NULL;
+}
+
+/** Serve tasks from coordinators on port; does not return. */
+int cluster_run_worker(u_short port, cluster_spawner spawner)
+{
+    WorkerSession *session;
+    pthread_t thread;
+    int sock, client;
+
+    signal(SIGPIPE, SIG_IGN);
+    sock = startup(&port);
+    INFO_LOG("transcode worker running on port %d\n", port);
+    while (1) {
+        client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                usleep(100000);
+            continue;
+        }
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        session = malloc(sizeof(*session));
+        if (session == NULL) {
+            close(client);
+            continue;
+        }
+        session->client = client;
+        session->spawner = spawner;
+        if (pthread_create(&thread, NULL, worker_session, session) != 0) {
+            close(client);
+            free(session);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
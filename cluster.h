@@ -0,0 +1,39 @@
+#pragma once
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CLUSTER_MAX_WORKERS 64
+#define CLUSTER_HEARTBEAT_INTERVAL 1    /* seconds a worker may stay silent */
+#define CLUSTER_WORKER_TIMEOUT 5        /* seconds of silence before a worker counts as lost */
+#define CLUSTER_WORKER_BACKOFF 10       /* seconds a lost worker gets no tasks */
+#define CLUSTER_MAX_ATTEMPTS 3          /* per task, across workers */
+#define CLUSTER_CHUNK_DURATION 10       /* seconds per GOP-aligned chunk */
+
+/**
+ * One unit of remote work: a request as the client made it, optionally cut
+ * to [start_time, end_time) on the source timeline. end_time < 0 runs the
+ * request as it is (a whole session).
+ */
+typedef struct ClusterTask {
+    char url[255];
+    char query[512];
+    double start_time;
+    double end_time;
+} ClusterTask;
+
+typedef struct ClusterRun ClusterRun;
+
+/** Worker side: start the transcode of a task, returns the read end of its output pipe. */
+typedef int (*cluster_spawner)(const ClusterTask *task, pid_t *pid);
+
+int cluster_add_workers(const char *addresses);
+int cluster_enabled();
+int cluster_workers();
+int cluster_start(ClusterTask *tasks, int nb_tasks, ClusterRun **run);
+int cluster_finish(ClusterRun *run);
+int cluster_run_worker(u_short port, cluster_spawner spawner);
+
+#endif
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <string.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+
+#include "codec_pool.h"
+
+typedef struct CodecPoolEntry {
+    CodecPoolKey key;
+    AVCodecContext *ctx;
+    int64_t put_time;
+} CodecPoolEntry;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static CodecPoolEntry pool_entries[CODEC_POOL_MAX_ENTRIES];
+static int pool_count = 0;
+static int pool_capacity = 0;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* a fork, prefork workers included, must not copy pool_lock held by another thread */
+static void pool_lock_prepare() {
+    pthread_mutex_lock(&pool_lock);
+}
+
+static void pool_lock_release() {
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void lock_pool_once() {
+    pthread_atfork(pool_lock_prepare, pool_lock_release, pool_lock_release);
+}
+
+static void lock_pool() {
+    pthread_once(&pool_once, lock_pool_once);
+    pthread_mutex_lock(&pool_lock);
+}
+
+static uint32_t hash_bytes(const uint8_t *data, int size) {
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void codec_pool_init(int capacity) {
+    lock_pool();
+    pool_capacity = FFMIN(FFMAX(capacity, 0), CODEC_POOL_MAX_ENTRIES);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void codec_pool_key_from_decoder(CodecPoolKey *key, const AVCodecParameters *par) {
+    memset(key, 0, sizeof(*key));
+    key->codec_id = par->codec_id;
+    key->is_encoder = 0;
+    key->width = par->width;
+    key->height = par->height;
+    key->sample_rate = par->sample_rate;
+    key->channel_layout = par->channel_layout;
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+        key->pix_fmt = par->format;
+    }else {
+        key->sample_fmt = par->format;
+    }
+    /* SPS/PPS or AudioSpecificConfig differ between files of the same size */
+    if (par->extradata && par->extradata_size > 0)
+        key->extradata_hash = hash_bytes(par->extradata, par->extradata_size);
+}
+
+void codec_pool_key_from_encoder(CodecPoolKey *key, const AVCodecContext *enc_ctx, AVDictionary *opts) {
+    char *opts_str = NULL;
+
+    memset(key, 0, sizeof(*key));
+    key->codec_id = enc_ctx->codec_id;
+    key->is_encoder = 1;
+    key->width = enc_ctx->width;
+    key->height = enc_ctx->height;
+    key->pix_fmt = enc_ctx->pix_fmt;
+    key->sample_rate = enc_ctx->sample_rate;
+    key->sample_fmt = enc_ctx->sample_fmt;
+    key->channel_layout = enc_ctx->channel_layout;
+    key->bit_rate = enc_ctx->bit_rate;
+    if (opts && av_dict_get_string(opts, &opts_str, '=', ':') >= 0 && opts_str) {
+        av_strlcpy(key->params, opts_str, sizeof(key->params));
+        av_free(opts_str);
+    }
+    /* time base and flags change the bitstream too, fold them into the params */
+    av_strlcatf(key->params, sizeof(key->params), "|tb=%d/%d|flags=%d|gop=%d:%d|bf=%d|vbv=%"PRId64":%d|threads=%d",
+        enc_ctx->time_base.num, enc_ctx->time_base.den, enc_ctx->flags,
+        enc_ctx->gop_size, enc_ctx->keyint_min, enc_ctx->max_b_frames,
+        (int64_t)enc_ctx->rc_max_rate, enc_ctx->rc_buffer_size, enc_ctx->thread_count);
+}
+
+/** Copy the settings open_output_file applies to a fresh encoder context. */
+static void copy_encoder_settings(AVCodecContext *dst, const AVCodecContext *src) {
+    dst->codec_type = src->codec_type;
+    dst->codec_id = src->codec_id;
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->sample_aspect_ratio = src->sample_aspect_ratio;
+    dst->pix_fmt = src->pix_fmt;
+    dst->time_base = src->time_base;
+    dst->framerate = src->framerate;
+    dst->me_range = src->me_range;
+    dst->qcompress = src->qcompress;
+    dst->me_subpel_quality = src->me_subpel_quality;
+    dst->max_b_frames = src->max_b_frames;
+    dst->gop_size = src->gop_size;
+    dst->keyint_min = src->keyint_min;
+    dst->bit_rate = src->bit_rate;
+    dst->rc_max_rate = src->rc_max_rate;
+    dst->rc_buffer_size = src->rc_buffer_size;
+    dst->sample_rate = src->sample_rate;
+    dst->channel_layout = src->channel_layout;
+    dst->channels = src->channels;
+    dst->sample_fmt = src->sample_fmt;
+    dst->strict_std_compliance = src->strict_std_compliance;
+    dst->flags = src->flags;
+    dst->thread_count = src->thread_count;
+}
+
+/** A freshly opened encoder with the settings of tmpl, which was opened with key. */
+AVCodecContext *codec_pool_open_like(const CodecPoolKey *key, const AVCodecContext *tmpl) {
+    AVCodecContext *ctx;
+    AVDictionary *opts = NULL;
+    char params[sizeof(key->params)];
+    char *sep;
+
+    ctx = avcodec_alloc_context3(tmpl->codec);
+    if (!ctx)
+        return NULL;
+    copy_encoder_settings(ctx, tmpl);
+
+    /* strip the "|tb=..." suffix added by codec_pool_key_from_encoder */
+    av_strlcpy(params, key->params, sizeof(params));
+    if ((sep = strchr(params, '|')))
+        *sep = '\0';
+    if (params[0])
+        av_dict_parse_string(&opts, params, "=", ":", 0);
+
+    if (avcodec_open2(ctx, tmpl->codec, &opts) < 0)
+        avcodec_free_context(&ctx);
+    av_dict_free(&opts);
+    return ctx;
+}
+
+AVCodecContext *codec_pool_get(const CodecPoolKey *key) {
+    AVCodecContext *ctx = NULL;
+    int i;
+
+    lock_pool();
+    for (i = 0; i < pool_count; i++) {
+        if (!memcmp(&pool_entries[i].key, key, sizeof(*key))) {
+            ctx = pool_entries[i].ctx;
+            pool_entries[i] = pool_entries[--pool_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return ctx;
+}
+
+/**
+ * Return a context to the pool. Decoders are flushed and kept as they are.
+ * Encoders that cannot be flushed after draining (libx264 among them) are
+ * replaced by a freshly opened context with the same settings, so the next
+ * session still skips the open cost.
+ */
+void codec_pool_put(const CodecPoolKey *key, AVCodecContext **ctx) {
+    AVCodecContext *reuse = NULL;
+    int i, oldest;
+
+    if (!ctx || !*ctx)
+        return;
+
+    lock_pool();
+    if (pool_capacity == 0 || !avcodec_is_open(*ctx)) {
+        pthread_mutex_unlock(&pool_lock);
+        avcodec_free_context(ctx);
+        return;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!key->is_encoder) {
+        avcodec_flush_buffers(*ctx);
+        reuse = *ctx;
+        *ctx = NULL;
+    }
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+    else if ((*ctx)->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH) {
+        avcodec_flush_buffers(*ctx);
+        reuse = *ctx;
+        *ctx = NULL;
+    }
+#endif
+    else {
+        reuse = codec_pool_open_like(key, *ctx);
+        avcodec_free_context(ctx);
+    }
+
+    if (!reuse)
+        return;
+
+    lock_pool();
+    if (pool_count >= pool_capacity) {
+        oldest = 0;
+        for (i = 1; i < pool_count; i++) {
+            if (pool_entries[i].put_time < pool_entries[oldest].put_time)
+                oldest = i;
+        }
+        avcodec_free_context(&pool_entries[oldest].ctx);
+        pool_entries[oldest] = pool_entries[--pool_count];
+    }
+    pool_entries[pool_count].key = *key;
+    pool_entries[pool_count].ctx = reuse;
+    pool_entries[pool_count].put_time = av_gettime_relative();
+    pool_count++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void codec_pool_clear() {
+    int i;
+
+    lock_pool();
+    for (i = 0; i < pool_count; i++)
+        avcodec_free_context(&pool_entries[i].ctx);
+    pool_count = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#ifndef _CODEC_POOL_H_
+#define _CODEC_POOL_H_
+
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+
+#define CODEC_POOL_MAX_ENTRIES 16
+
+/**
+ * Identifies an opened codec context. Two contexts with the same key are
+ * interchangeable once flushed, so a session may take any of them.
+ */
+typedef struct CodecPoolKey {
+    enum AVCodecID codec_id;
+    int is_encoder;
+    int width;
+    int height;
+    int pix_fmt;
+    int sample_rate;
+    int sample_fmt;
+    uint64_t channel_layout;
+    int64_t bit_rate;
+    uint32_t extradata_hash;
+    char params[256];
+} CodecPoolKey;
+
+void codec_pool_init(int capacity);
+void codec_pool_key_from_decoder(CodecPoolKey *key, const AVCodecParameters *par);
+void codec_pool_key_from_encoder(CodecPoolKey *key, const AVCodecContext *enc_ctx, AVDictionary *opts);
+AVCodecContext *codec_pool_get(const CodecPoolKey *key);
+void codec_pool_put(const CodecPoolKey *key, AVCodecContext **ctx);
+AVCodecContext *codec_pool_open_like(const CodecPoolKey *key, const AVCodecContext *tmpl);
+void codec_pool_clear();
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
+
+#include "decimate.h"
+
+/** Sum of absolute differences of a block of at most DECIMATE_BLOCK_SIZE bytes by rows. */
+static int block_sad(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    int x, y, sad = 0;
+
+#ifdef __SSE2__
+    if (width == DECIMATE_BLOCK_SIZE) {
+        __m128i sum = _mm_setzero_si128();
+
+        for (y = 0; y < height; y++) {
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + y * a_stride)),
+                _mm_loadu_si128((const __m128i *)(b + y * b_stride))));
+        }
+        return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+#endif
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++)
+            sad += abs(a[y * a_stride + x] - b[y * b_stride + x]);
+    }
+    return sad;
+}
+
+/**
+ * Whether two pictures match, block by block over every plane. One changed
+ * block is enough, so a moving cursor on a still screen is never dropped,
+ * and changing content is told apart in the first rows.
+ */
+static int same_picture(const AVFrame *a, const AVFrame *b)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(a->format);
+    int plane, planes, width, height, x, y, bw, bh;
+
+    if (a->format != b->format || a->width != b->width || a->height != b->height || desc == NULL
+        || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return 0;
+
+    planes = av_pix_fmt_count_planes(a->format);
+    for (plane = 0; plane < planes; plane++) {
+        width = av_image_get_linesize(a->format, a->width, plane);
+        height = plane == 1 || plane == 2 ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+        if (width <= 0)
+            return 0;
+        for (y = 0; y < height; y += DECIMATE_BLOCK_SIZE) {
+            const uint8_t *pa = a->data[plane] + (int64_t)y * a->linesize[plane];
+            const uint8_t *pb = b->data[plane] + (int64_t)y * b->linesize[plane];
+
+            bh = FFMIN(DECIMATE_BLOCK_SIZE, height - y);
+            for (x = 0; x < width; x += DECIMATE_BLOCK_SIZE) {
+                bw = FFMIN(DECIMATE_BLOCK_SIZE, width - x);
+                if (block_sad(pa + x, a->linesize[plane], pb + x, b->linesize[plane], bw, bh)
+                    > bw * bh * DECIMATE_PIXEL_DIFF)
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/** out_time_base is the encoder's; frames are passed on with their timestamps in time_base. */
+int decimate_init(DecimateContext *ctx, AVRational time_base, AVRational out_time_base)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->time_base = time_base;
+    ctx->out_time_base = out_time_base;
+    ctx->last_tick = AV_NOPTS_VALUE;
+    ctx->last = av_frame_alloc();
+    ctx->held = av_frame_alloc();
+    if (ctx->last == NULL || ctx->held == NULL) {
+        decimate_uninit(ctx);
+        return AVERROR(ENOMEM);
+    }
+    ctx->enabled = 1;
+    return 0;
+}
+
+/**
+ * Returns 1 when the frame should be dropped: it repeats the last frame
+ * passed on, or falls on an encoder tick that already has a frame. A
+ * duplicate is still passed on once every DECIMATE_MAX_GAP seconds, so
+ * keyframe intervals and players' stall detection see regular frames.
+ */
+int decimate_frame(DecimateContext *ctx, const AVFrame *frame)
+{
+    int64_t tick;
+
+    if (!ctx->enabled || frame->pts == AV_NOPTS_VALUE)
+        return 0;
+    ctx->frames++;
+
+    tick = av_rescale_q(frame->pts, ctx->time_base, ctx->out_time_base);
+    if (ctx->last_tick != AV_NOPTS_VALUE && tick <= ctx->last_tick) {
+        ctx->dropped++;
+        return 1;
+    }
+    if (ctx->last->buf[0] != NULL && same_picture(frame, ctx->last)
+        && av_compare_ts(frame->pts - ctx->last->pts, ctx->time_base, DECIMATE_MAX_GAP, (AVRational){ 1, 1 }) < 0) {
+        av_frame_unref(ctx->held);
+        if (av_frame_ref(ctx->held, frame) < 0)
+            av_frame_unref(ctx->held);
+        ctx->dropped++;
+        return 1;
+    }
+
+    av_frame_unref(ctx->held);
+    av_frame_unref(ctx->last);
+    if (av_frame_ref(ctx->last, frame) < 0)
+        av_frame_unref(ctx->last);
+    ctx->last_tick = tick;
+    return 0;
+}
+
+/** The duplicate held back at the end of the stream, or NULL; the caller frees it. */
+AVFrame *decimate_flush(DecimateContext *ctx)
+{
+    AVFrame *frame;
+
+    if (!ctx->enabled || ctx->held == NULL || ctx->held->buf[0] == NULL)
+        return NULL;
+    frame = av_frame_clone(ctx->held);
+    av_frame_unref(ctx->held);
+    return frame;
+}
+
+void decimate_uninit(DecimateContext *ctx)
+{
+    av_frame_free(&ctx->last);
+    av_frame_free(&ctx->held);
+    ctx->enabled = 0;
+}
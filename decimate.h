@@ -0,0 +1,35 @@
+#pragma once
+#ifndef _DECIMATE_H_
+#define _DECIMATE_H_
+
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+
+#define DECIMATE_BLOCK_SIZE 16
+#define DECIMATE_PIXEL_DIFF 2       /* mean absolute difference a block may have and still match */
+#define DECIMATE_MAX_GAP 1          /* seconds: a duplicate is still passed on this often */
+
+/**
+ * Drops decoded video frames that repeat the previous one, before they
+ * reach the filters and the encoder. Frames that are passed on keep their
+ * source timestamps, so a dropped run just lengthens the frame before it.
+ */
+typedef struct DecimateContext {
+    int enabled;
+    AVRational time_base;       /* of the frames */
+    AVRational out_time_base;   /* of the encoder: at most one frame per tick is passed on */
+    AVFrame *last;              /* last frame passed on */
+    AVFrame *held;              /* newest duplicate, sent at the end so the last picture keeps its duration */
+    int64_t last_tick;
+    int frames;
+    int dropped;
+} DecimateContext;
+
+int decimate_init(DecimateContext *ctx, AVRational time_base, AVRational out_time_base);
+int decimate_frame(DecimateContext *ctx, const AVFrame *frame);
+AVFrame *decimate_flush(DecimateContext *ctx);
+void decimate_uninit(DecimateContext *ctx);
+
+#endif
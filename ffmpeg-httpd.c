@@ -1,8 +1,21 @@
 #include <stdio.h>
+#include <signal.h>
+#include <sys/sendfile.h>
 #include <libavutil/time.h>
+#include <libavutil/avstring.h>
 
 #include "server.h"
 #include "ffmpeg.h"
+#include "live.h"
+#include "cache.h"
+#include "kfindex.h"
+#include "log.h"
+#include "tls.h"
+#include "jobs.h"
+#include "cluster.h"
+#include "prefork.h"
+#include "trace.h"
+#include "hls.h"
 
 #define STDIN   0
 #define STDOUT  1
@@ -11,50 +24,363 @@
 
 char *file_path = "/mnt/hgfs/web/c++/http-ffmpeg-transocding/build%s";
 
-void http_transcoding_handler(int client, const char *path, const char *method, const char *query_string)
+/**
+ * Request options: profile=lowlatency, gop=<frames>, intra_refresh=1,
+ * maxrate=<kbit/s>, bufsize=<kbit>, muxrate=<kbit/s>, max_delay=<ms>,
+ * format=ts|fmp4|cmaf, start=<seconds>, end=<seconds>, rc=auto|abr, crf=<value>,
+ * size=<long>x<short>|source, fps=<max>|0, passthrough=0,
+ * video=<tracks>, audio=<tracks> (indexes, languages, all or none),
+ * decimate=1, trace=1.
+ */
+static void parse_encode_param(const char *query_string, EncodeParam *param)
 {
-    printf("【method=%s, query_string=%s】path=%s;\n", method, query_string, path);
+    char value[64];
+
+    init_encode_param(param);
+    if (get_query_param(query_string, "profile", value, sizeof(value)) > 0
+        && (strcmp(value, "lowlatency") == 0 || strcmp(value, "live") == 0))
+        param->profile = PROFILE_LOW_LATENCY;
+    if (get_query_param(query_string, "gop", value, sizeof(value)) > 0)
+        param->gop_size = atoi(value);
+    if (get_query_param(query_string, "intra_refresh", value, sizeof(value)) >= 0)
+        param->intra_refresh = value[0] == '\0' || atoi(value) != 0;
+    if (get_query_param(query_string, "maxrate", value, sizeof(value)) > 0)
+        param->vbv_maxrate = atoi(value) * 1000;
+    if (get_query_param(query_string, "bufsize", value, sizeof(value)) > 0)
+        param->vbv_bufsize = atoi(value) * 1000;
+    if (get_query_param(query_string, "muxrate", value, sizeof(value)) > 0)
+        param->muxrate = atoi(value) * 1000;
+    if (get_query_param(query_string, "max_delay", value, sizeof(value)) > 0)
+        param->mux_max_delay = atoi(value) * 1000;
+    if (get_query_param(query_string, "start", value, sizeof(value)) > 0)
+        param->start_time = atof(value);
+    if (get_query_param(query_string, "end", value, sizeof(value)) > 0)
+        param->end_time = atof(value);
+    if (get_query_param(query_string, "format", value, sizeof(value)) > 0
+        && output_format_find(value) != NULL)
+        param->output = output_format_find(value);
+    if (get_query_param(query_string, "rc", value, sizeof(value)) > 0 && strcmp(value, "auto") == 0)
+        param->rate_control = RC_AUTO;
+    if (get_query_param(query_string, "crf", value, sizeof(value)) > 0)
+        param->crf = atof(value);
+    if (get_query_param(query_string, "size", value, sizeof(value)) > 0) {
+        if (strcmp(value, "source") == 0)
+            param->max_width = param->max_height = 0;
+        else if (sscanf(value, "%dx%d", &param->max_width, &param->max_height) != 2)
+            param->max_height = 0;
+    }
+    if (get_query_param(query_string, "fps", value, sizeof(value)) > 0)
+        param->max_fps = atoi(value);
+    if (get_query_param(query_string, "trace", value, sizeof(value)) >= 0)
+        param->trace = value[0] == '\0' || atoi(value) != 0;
+    if (get_query_param(query_string, "decimate", value, sizeof(value)) >= 0)
+        param->decimate = value[0] == '\0' || atoi(value) != 0;
+    if (get_query_param(query_string, "passthrough", value, sizeof(value)) > 0)
+        param->passthrough = atoi(value) != 0;
+    get_query_param(query_string, "video", param->video_tracks, sizeof(param->video_tracks));
+    get_query_param(query_string, "audio", param->audio_tracks, sizeof(param->audio_tracks));
+}
+
+/** Cache key of a rendition; cached renditions default to rc=auto. */
+static void rendition_key(const char *path, const char *query_string, EncodeParam *param, char *key)
+{
+    char signature[256];
+    char value[16];
+
+    /* cached renditions are served many times: spend a pass on sizing them */
+    if (get_query_param(query_string, "rc", value, sizeof(value)) < 0)
+        param->rate_control = RC_AUTO;
+    encode_param_signature(param, signature, sizeof(signature));
+    cache_make_key(path, signature, key);
+}
+
+/**
+ * Split a request into cluster tasks: GOP-aligned chunks when the output
+ * can be joined back by concatenation, otherwise the whole session as one
+ * task. Returns the number of tasks.
+ */
+static int plan_cluster_tasks(const HttpRequest *request, const EncodeParam *param, ClusterTask **ptasks)
+{
+    KeyframeIndex *index = NULL;
+    ClusterTask *tasks;
+    char query[512], value[16];
+    int *starts = NULL;
+    int i, nb_tasks = 1;
+    double origin = 0;
+
+    /* workers parse the query again: carry the cache's rc=auto default over */
+    snprintf(query, sizeof(query), "%s", request->query_string);
+    if (param->rate_control == RC_AUTO && get_query_param(query, "rc", value, sizeof(value)) < 0)
+        av_strlcatf(query, sizeof(query), "%src=auto", query[0] ? "&" : "");
+    /* and an X-Trace header: every worker traces its own part */
+    if (param->trace && get_query_param(query, "trace", value, sizeof(value)) < 0)
+        av_strlcatf(query, sizeof(query), "%strace=1", query[0] ? "&" : "");
+
+    /* MPEG-TS is the one output that stays valid cut at keyframes and concatenated */
+    if (strcmp(param->output->muxer, "mpegts") == 0 && param->start_time <= 0 && param->end_time <= 0
+        && kfindex_load(request->path, &index) >= 0)
+        kfindex_plan_chunks(index, av_rescale_q(CLUSTER_CHUNK_DURATION, (AVRational){ 1, 1 },
+            index->time_base), &starts, &nb_tasks);
+    if (nb_tasks < 1) {
+        av_freep(&starts);
+        nb_tasks = 1;
+    }
+
+    tasks = calloc(nb_tasks, sizeof(*tasks));
+    if (tasks == NULL) {
+        av_free(starts);
+        kfindex_free(&index);
+        return -1;
+    }
+    if (starts != NULL)
+        origin = index->entries[0].pts * av_q2d(index->time_base);
+    for (i = 0; i < nb_tasks; i++) {
+        snprintf(tasks[i].url, sizeof(tasks[i].url), "%s", request->url);
+        snprintf(tasks[i].query, sizeof(tasks[i].query), "%s", query);
+        if (starts == NULL) {
+            tasks[i].start_time = tasks[i].end_time = -1;
+            continue;
+        }
+        tasks[i].start_time = index->entries[starts[i]].pts * av_q2d(index->time_base) - origin;
+        if (i + 1 < nb_tasks)
+            tasks[i].end_time = index->entries[starts[i + 1]].pts * av_q2d(index->time_base) - origin;
+        else /* past the end, so the last chunk is cut like the others */
+            tasks[i].end_time = index->duration * av_q2d(index->time_base) - origin + 1;
+    }
+    INFO_LOG("cluster: %s in %d task(s) on %d worker(s)\n", request->url, nb_tasks, cluster_workers());
+    av_free(starts);
+    kfindex_free(&index);
+    *ptasks = tasks;
+    return nb_tasks;
+}
+
+/** Worker side of -worker: transcode one task as the coordinator described it. */
+static int spawn_cluster_task(const ClusterTask *task, pid_t *pid)
+{
+    char path[512];
+    EncodeParam param;
+
+    snprintf(path, sizeof(path), file_path, task->url);
+    parse_encode_param(task->query, &param);
+    if (task->end_time >= 0) {
+        param.start_time = task->start_time;
+        param.end_time = task->end_time;
+        /* a chunk is whole GOPs: smart rendering would copy it all */
+        param.clip_reencode = 1;
+    }
+    return spawn_trans_task(path, &param, pid);
+}
+
+/** Stream a cache file that another request is still writing, following its growth. */
+static void follow_transcode(int client, HttpRequest *request, CacheWriter *writer, int fd, const char *content_type)
+{
+    off_t offset = 0;
+    int64_t available;
+
+    write_stream_header(client, request, content_type);
+    while ((available = cache_wait(writer, offset)) > 0) {
+        if (sendfile_body(client, request, fd, &offset, available) < 0)
+            return;
+    }
+    if (available == 0)
+        end_body(client, request);
+    else
+        request->keep_alive = 0;
+}
+
+void http_transcoding_handler(int client, HttpRequest *request)
+{
+    const char *path = request->path;
+    static int request_counter = 0;
+
+    log_set_tag("r%d", __atomic_add_fetch(&request_counter, 1, __ATOMIC_RELAXED));
+    INFO_LOG("%s %s?%s\n", request->method, request->url, request->query_string);
 
     int ret;
-    int pfds[2];
+    int fd;
     pid_t pid;
+    int64_t request_time = av_gettime_relative();
+    int first_byte = 1;
+    EncodeParam param;
+    const LiveSource *source;
+    char key[CACHE_KEY_SIZE];
+    CacheEntry *entry;
+    CacheWriter *writer = NULL;
+    ClusterTask *tasks;
+    ClusterRun *cluster_run = NULL;
+    int worker = -1;
+    int follow_fd = -1;
+    int client_alive = 1;
+    int status = 0;
+    int completed;
 
-    ret = pipe(pfds);
-    if (ret< 0) {
-        cannot_execute(client);
+    if (strncmp(request->url, JOBS_URL_PREFIX, strlen(JOBS_URL_PREFIX)) == 0) {
+        jobs_serve(client, request);
+        return;
+    }
+    if (strcasecmp(request->method, "GET") != 0) {
+        send_response(client, "405 Method Not Allowed", "text/plain", "Allow: GET\r\n",
+            "only GET is supported here\n");
         return;
     }
 
-    pid = fork();
-    if(pid < 0){
-        cannot_execute(client);
+    parse_encode_param(request->query_string, &param);
+    param.trace |= request->trace;
+
+    if (strncmp(request->url, HLS_URL_PREFIX, strlen(HLS_URL_PREFIX)) == 0) {
+        hls_serve(client, request, &param);
         return;
-    }else if(pid == 0){
-        dup2(pfds[1], STDOUT);
-        close(pfds[0]);
-        av_log_set_level(AV_LOG_ERROR);
-        create_trans_task(path, "pipe:");
-        return ;
-    }else{
-        
-        write_ts_header(client);
-        close(pfds[1]);
-        size_t bytes;
-        char buffer[BLOCK_SIZE];
-
-        while ((ret = read(pfds[0], buffer, sizeof(buffer))) > 0){
-            send(client, buffer, ret, 0);
+    }
+
+    if (strncmp(request->url, LIVE_URL_PREFIX, strlen(LIVE_URL_PREFIX)) == 0) {
+        source = live_find_source(request->url + strlen(LIVE_URL_PREFIX));
+        if (source == NULL) {
+            not_found(client);
+            return;
         }
-        shutdown(client, SHUT_RDWR);
-        close(pfds[0]);
+        /* viewers join mid-stream, which only works without an init segment */
+        param.output = output_format_default();
+        /* the shared fan-out writes raw bytes: the body ends with the connection */
+        request->keep_alive = 0;
+        live_serve(client, source, request->query_string, &param);
+        INFO_LOG("live viewer left %s\n", request->url);
+        return;
     }
 
+    kfindex_ensure(path);
 
+    if (cache_enabled()) {
+        rendition_key(path, request->query_string, &param, key);
+        switch (cache_open(key, param.output->extension, 0, &entry, &writer, &follow_fd)) {
+        case CACHE_HIT:
+            INFO_LOG("cache hit %s for %s\n", key, path);
+            serve_file(client, request, entry->path, param.output->content_type);
+            cache_release(entry);
+            return;
+        case CACHE_FOLLOW:
+            /* someone is transcoding this already: tail their output */
+            INFO_LOG("following in-progress transcode %s for %s\n", key, path);
+            follow_transcode(client, request, writer, follow_fd, param.output->content_type);
+            close(follow_fd);
+            cache_unfollow(writer);
+            return;
+        default:
+            break;
+        }
+    }
 
-    printf("transcoding end!\n");
-    return(0);
+    if (cluster_enabled() && (ret = plan_cluster_tasks(request, &param, &tasks)) > 0)
+        fd = cluster_start(tasks, ret, &cluster_run);
+    else if ((fd = prefork_start(path, &param, &worker)) < 0)
+        fd = spawn_trans_task((char *)path, &param, &pid);
+    if (fd < 0) {
+        if (writer != NULL)
+            cache_commit(writer, 0);
+        cannot_execute(client);
+        return;
+    }
+
+    write_stream_header(client, request, param.output->content_type);
+    char buffer[BLOCK_SIZE];
+
+    while ((ret = read(fd, buffer, sizeof(buffer))) > 0){
+        if (first_byte) {
+            first_byte = 0;
+            INFO_LOG("latency: first byte to client after %0.3fs\n",
+                (av_gettime_relative() - request_time) / 1000000.0);
+        }
+        if (writer != NULL && cache_write(writer, buffer, ret) < 0) {
+            cache_commit(writer, 0);
+            writer = NULL;
+        }
+        if (client_alive && send_body(client, request, buffer, ret) < 0) {
+            client_alive = 0;
+            /* without a cache entry to finish there is no point going on */
+            if (writer == NULL)
+                break;
+        }
+    }
+    close(fd);
+    if (cluster_run != NULL) {
+        /* closing the pipe stops the run early */
+        completed = cluster_finish(cluster_run) == 0 && ret == 0;
+    }else if (worker >= 0) {
+        completed = prefork_finish(worker, ret > 0) == 0 && ret == 0;
+    }else {
+        if (ret > 0)
+            kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+        completed = ret == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    if (writer != NULL)
+        cache_commit(writer, completed);
+    /* a failed transcode must not look like a complete body */
+    if (client_alive && completed)
+        end_body(client, request);
+    else
+        request->keep_alive = 0;
+
+    INFO_LOG("transcoding end!\n");
 }
 
+/**
+ * Job runner: put one rendition in the cache. A transcode that a viewer
+ * already started is waited for rather than repeated.
+ */
+static int run_job(const Job *job)
+{
+    char path[512];
+    char key[CACHE_KEY_SIZE];
+    char buffer[BLOCK_SIZE];
+    EncodeParam param;
+    CacheEntry *entry;
+    CacheWriter *writer;
+    int64_t available, offset = 0;
+    int fd, ret, status = 0, completed;
+    pid_t pid;
+
+    snprintf(path, sizeof(path), file_path, job->url);
+    parse_encode_param(job->query, &param);
+    kfindex_ensure(path);
+    rendition_key(path, job->query, &param, key);
+    switch (cache_open(key, param.output->extension, 1, &entry, &writer, &fd)) {
+    case CACHE_HIT:
+        INFO_LOG("already cached %s for %s\n", key, path);
+        cache_release(entry);
+        return 0;
+    case CACHE_FOLLOW:
+        while ((available = cache_wait(writer, offset)) > 0)
+            offset += available;
+        close(fd);
+        cache_unfollow(writer);
+        return available == 0 ? 0 : -1;
+    default:
+        if (writer == NULL)
+            return -1;
+        break;
+    }
+
+    param.background = 1;
+    fd = spawn_trans_task(path, &param, &pid);
+    if (fd < 0) {
+        cache_commit(writer, 0);
+        return -1;
+    }
+    cache_set_background(writer, pid);
+    while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (cache_write(writer, buffer, ret) < 0)
+            break;
+    }
+    close(fd);
+    /* before the pid can be reused */
+    cache_set_background(writer, 0);
+    if (ret > 0)
+        kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    completed = ret == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    cache_commit(writer, completed);
+    return completed ? 0 : -1;
+}
 
 int run_transcoding() {
     int ret;
@@ -63,9 +389,10 @@ int run_transcoding() {
     //char *inputFile = "./build/input01.ts";
     char *outputFile = "./build/output.ts";
     av_log_set_level(AV_LOG_VERBOSE);
+    codec_pool_init(4);
     ti = av_gettime_relative();
     //ret = create_trans_task(inputFile, "pipe:");
-    ret = create_trans_task(inputFile, outputFile);
+    ret = create_trans_task(inputFile, outputFile, NULL);
     if (ret < 0) {
         printf("fail!\n");
     }
@@ -73,9 +400,157 @@ int run_transcoding() {
     return 0;
 }
 
+typedef struct StressJob {
+    char *input;
+    char output[64];
+    int ret;
+} StressJob;
+
+static void *stress_thread(void *arg)
+{
+    StressJob *job = arg;
+
+    job->ret = create_trans_task(job->input, job->output, NULL);
+    return NULL;
+}
+
+/** Run many transcode sessions at once in this process (see TSAN=1 in the Makefile). */
+static int run_stress(int sessions, char *input)
+{
+    StressJob *jobs;
+    pthread_t *threads;
+    int64_t ti;
+    int i, started, failed = 0;
+
+    jobs = calloc(sessions, sizeof(*jobs));
+    threads = calloc(sessions, sizeof(*threads));
+    if (!jobs || !threads) {
+        free(jobs);
+        free(threads);
+        return 1;
+    }
+    init_ffmpeg();
+    ti = av_gettime_relative();
+    for (started = 0; started < sessions; started++) {
+        jobs[started].input = input;
+        snprintf(jobs[started].output, sizeof(jobs[started].output), "./build/stress-%d.ts", started);
+        if (pthread_create(&threads[started], NULL, stress_thread, &jobs[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].ret < 0) {
+            fprintf(stderr, "session %d failed: %s\n", i, av_err2str(jobs[i].ret));
+            failed++;
+        }
+    }
+    printf("stress: %d sessions, %d failed, %0.3fs\n", started, failed,
+        (av_gettime_relative() - ti) / 1000000.0);
+    free(jobs);
+    free(threads);
+    return failed || started < sessions ? 1 : 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p port] [-live name=url[,wallclock]]... [-cache dir] [-cache-size MB] [-drain seconds]\n"
+        "       [-keepalive seconds] [-tls cert.pem key.pem] [-jobs workers] [-workers host:port,...]\n"
+        "       [-session-memory MB] [-prefork workers] [-trace-dir dir]\n", name);
+    fprintf(stderr, "       %s -worker port [-session-memory MB] [-trace-dir dir]\n", name);
+    fprintf(stderr, "       %s -stress sessions [input]\n", name);
+    fprintf(stderr, "       without arguments, transcode ./build/input.mp4 once\n");
+}
+
 int main(int argc, char **argv){
     u_short port = 4000;
-    //run_server(port, http_transcoding_handler);
-    run_transcoding();
+    int i;
+    const char *cache_dir = NULL;
+    int64_t cache_size = 10240LL * 1024 * 1024;
+    const char *tls_cert = NULL, *tls_key = NULL;
+    int job_workers = 0;
+    u_short worker_port = 0;
+    int prefork_workers = 0;
+
+    if (argc < 2) {
+        run_transcoding();
+        return 0;
+    }
+    if (strcmp(argv[1], "-stress") == 0 && argc > 2) {
+        codec_pool_init(4);
+        log_init();
+        return run_stress(atoi(argv[2]), argc > 3 ? argv[3] : "./build/input.mp4");
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        }else if (strcmp(argv[i], "-live") == 0 && i + 1 < argc) {
+            if (live_add_source(argv[++i]) < 0) {
+                fprintf(stderr, "invalid live source '%s'\n", argv[i]);
+                return 1;
+            }
+        }else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        }else if (strcmp(argv[i], "-cache-size") == 0 && i + 1 < argc) {
+            cache_size = atoll(argv[++i]) * 1024 * 1024;
+        }else if (strcmp(argv[i], "-drain") == 0 && i + 1 < argc) {
+            set_drain_timeout(atoi(argv[++i]));
+        }else if (strcmp(argv[i], "-keepalive") == 0 && i + 1 < argc) {
+            set_keepalive_timeout(atoi(argv[++i]));
+        }else if (strcmp(argv[i], "-tls") == 0 && i + 2 < argc) {
+            tls_cert = argv[++i];
+            tls_key = argv[++i];
+        }else if (strcmp(argv[i], "-jobs") == 0 && i + 1 < argc) {
+            job_workers = atoi(argv[++i]);
+        }else if (strcmp(argv[i], "-session-memory") == 0 && i + 1 < argc) {
+            set_session_memory_limit(atoll(argv[++i]) * 1024 * 1024);
+        }else if (strcmp(argv[i], "-trace-dir") == 0 && i + 1 < argc) {
+            trace_set_dir(argv[++i]);
+        }else if (strcmp(argv[i], "-prefork") == 0 && i + 1 < argc) {
+            prefork_workers = atoi(argv[++i]);
+        }else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc) {
+            if (cluster_add_workers(argv[++i]) < 0) {
+                fprintf(stderr, "invalid worker list '%s'\n", argv[i]);
+                return 1;
+            }
+        }else if (strcmp(argv[i], "-worker") == 0 && i + 1 < argc) {
+            worker_port = atoi(argv[++i]);
+        }else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (worker_port != 0) {
+        log_init();
+        init_ffmpeg();
+        return cluster_run_worker(worker_port, spawn_cluster_task);
+    }
+
+    if (cache_dir != NULL && cache_init(cache_dir, cache_size) < 0) {
+        perror(cache_dir);
+        return 1;
+    }
+    if (job_workers > 0 && cache_dir == NULL) {
+        fprintf(stderr, "-jobs needs -cache: jobs only fill the cache\n");
+        return 1;
+    }
+
+    log_init();
+    if (tls_cert != NULL && tls_init(tls_cert, tls_key) < 0)
+        return 1;
+    init_ffmpeg();
+    /* before the indexer, job and connection threads: the zygote forked here must be single-threaded */
+    if (prefork_workers > 0 && prefork_init(prefork_workers) < 0) {
+        perror("prefork");
+        return 1;
+    }
+    kfindex_start_indexer();
+    if (job_workers > 0 && jobs_init(cache_dir, job_workers, run_job) < 0)
+        return 1;
+    run_server(port, http_transcoding_handler);
+    printf("httpd stopped\n");
     return 0;
 }
\ No newline at end of file
@@ -1,40 +1,290 @@
 #include "ffmpeg.h"
-
+#include "mmap_io.h"
+#include "kfindex.h"
+#include "analyze.h"
+#include "log.h"
+#include "trace.h"
+
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <libavutil/avstring.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
 #include <libavutil/timestamp.h>
 
-#define DEBUG_LOG(fmt, ...) av_log(NULL, AV_LOG_DEBUG, "[%s:%d] DEBUG: " fmt, __FILE__, __LINE__, ##__VA_ARGS__);
-#define INFO_LOG(fmt, ...) av_log(NULL, AV_LOG_INFO, "[%s:%d] INFO: " fmt, __FILE__, __LINE__, ##__VA_ARGS__);
-#define ERROR_LOG(fmt, ...) av_log(NULL, AV_LOG_ERROR, "[%s:%d] ERROR: " fmt, __FILE__, __LINE__, ##__VA_ARGS__);
-#define WARNING_LOG(fmt, ...) av_log(NULL, AV_LOG_WARNING, "[%s:%d] WARNING: " fmt, __FILE__, __LINE__, ##__VA_ARGS__);
-#define FATAL_LOG(fmt, ...) av_log(NULL, AV_LOG_FATAL, "[%s:%d] FATAL: " fmt, __FILE__, __LINE__, ##__VA_ARGS__);
+#define LIVE_RECONNECT_ATTEMPTS 10
+#define ANALYZE_MAX_SECONDS 120
+/* consecutive av_read_frame failures before a file input is given up */
+#define MAX_READ_ERRORS 32
+/* output normalization defaults, sized for the default bitrate */
+#define DEFAULT_MAX_WIDTH 1280
+#define DEFAULT_MAX_HEIGHT 720
+#define DEFAULT_MAX_FPS 30
+/* -session-memory split, in percent; the rest is left to the process itself */
+#define MEMORY_SHARE_DEMUX 10
+#define MEMORY_SHARE_FRAMES 15
+#define MEMORY_SHARE_ENCODER 50
+#define MEMORY_SHARE_MUX 15
+#define DEFAULT_PROBESIZE 5000000
+#define DEFAULT_INDEXMEM (1 << 20)
+#define DECODER_REFERENCE_PICTURES 4    /* typical H.264 DPB at 1080p */
+/* x264 defaults (preset medium) and what each of its pictures costs */
+#define X264_DEFAULT_LOOKAHEAD 40
+#define X264_MIN_LOOKAHEAD 10           /* below this mbtree has little to work with */
+#define X264_DEFAULT_REFS 3
+#define X264_MAX_AUTO_THREADS 16
+#define X264_PICTURE_FACTOR 3           /* bytes per pixel with lowres and subpel planes */
+#define MAX_INTERLEAVE_DELTA 10000000   /* the muxer's default */
+#define MIN_INTERLEAVE_DELTA 200000
+#define FALLBACK_BIT_RATE 8000000
+#define SEGMENT_IO_BUFFER_SIZE 32768
 
-static stream_video_index;
-static stream_audio_index;
 static enum log_level_enum log_level = INFO;
-static EncodeParam default_encode_param = {
-    "libx264", "aac", 900000,
+static const EncodeParam default_encode_param = {
+    "libx264", "aac", 880000,
 };
+static pthread_once_t ffmpeg_once = PTHREAD_ONCE_INIT;
+static int session_counter = 0;
+static int64_t session_memory_limit = 0;
 
 enum log_level_enum getLogLevel() {
     return log_level;
 }
 
+/* process wide: av_log has a single level, so set this before starting sessions */
 void set_log_level(enum log_level_enum level) {
     log_level = level;
+    av_log_set_level(level);
+    log_set_level(level);
+}
+
+/** Bytes one session may use, 0 = FFmpeg and x264 defaults. Process wide, like the log level. */
+void set_session_memory_limit(int64_t bytes) {
+    session_memory_limit = bytes;
+}
+
+static int64_t memory_share(int percent) {
+    return session_memory_limit * percent / 100;
+}
+
+void init_encode_param(EncodeParam *param) {
+    *param = default_encode_param;
+    param->output = output_format_default();
+    param->max_width = DEFAULT_MAX_WIDTH;
+    param->max_height = DEFAULT_MAX_HEIGHT;
+    param->max_fps = DEFAULT_MAX_FPS;
+    param->passthrough = 1;
+}
+
+/** Everything in an EncodeParam that changes the output bytes, as a string. */
+void encode_param_signature(const EncodeParam *param, char *buf, int size) {
+    snprintf(buf, size, "v=%s:a=%s:b=%d:p=%d:g=%d:ir=%d:vbv=%d/%d:md=%d:mr=%d:f=%s:ss=%0.3f:rc=%d/%0.1f:sz=%dx%d@%d:pt=%d:vt=%s:at=%s:to=%0.3f:dc=%d",
+        param->vcoder, param->acoder, param->vbitrate, param->profile, param->gop_size,
+        param->intra_refresh, param->vbv_maxrate, param->vbv_bufsize,
+        param->mux_max_delay, param->muxrate, param->output->name, param->start_time,
+        param->rate_control, param->crf, param->max_width, param->max_height, param->max_fps,
+        param->passthrough, param->video_tracks, param->audio_tracks, param->end_time, param->decimate);
+}
+
+/**
+ * Output size: the source scaled down, never up, so its longer side fits
+ * max_width and its shorter side max_height. Dimensions stay even for 4:2:0.
+ */
+static void normalized_size(const EncodeParam *encode_param, int width, int height, int *out_width, int *out_height) {
+    int long_side = FFMAX(width, height), short_side = FFMIN(width, height);
+    double scale = 1.0;
+
+    if (encode_param->max_width > 0 && long_side > encode_param->max_width)
+        scale = (double)encode_param->max_width / long_side;
+    if (encode_param->max_height > 0 && short_side * scale > encode_param->max_height)
+        scale = (double)encode_param->max_height / short_side;
+    if (scale >= 1.0) {
+        *out_width = width;
+        *out_height = height;
+        return;
+    }
+    *out_width = FFMAX(2, (int)(width * scale) & ~1);
+    *out_height = FFMAX(2, (int)(height * scale) & ~1);
+}
+
+/**
+ * Whether a subtitle/data stream can be copied into this muxer. Muxers
+ * without a codec tag table cannot answer, so for those only the codecs
+ * mpegts is known to carry are allowed.
+ */
+static int can_remux(const AVOutputFormat *oformat, enum AVCodecID codec_id) {
+    int ret = avformat_query_codec(oformat, codec_id, FF_COMPLIANCE_NORMAL);
+
+    if (ret >= 0)
+        return ret == 1;
+    return codec_id == AV_CODEC_ID_DVB_SUBTITLE || codec_id == AV_CODEC_ID_DVB_TELETEXT
+        || codec_id == AV_CODEC_ID_TIMED_ID3;
 }
 
-void set_av_log_level() {
-    av_log_set_level(log_level);
+/** x264 settings of the low-latency profile; values given in the request win. */
+static void apply_low_latency_profile(const EncodeParam *encode_param, AVCodecContext *enc_ctx, AVDictionary **opts) {
+    av_dict_set(opts, "preset", "veryfast", 0);
+    av_dict_set(opts, "tune", "zerolatency", 0);
+    /* one second GOP unless the request asked for something else */
+    if (encode_param->gop_size <= 0 && enc_ctx->framerate.num > 0) {
+        enc_ctx->gop_size = (enc_ctx->framerate.num + enc_ctx->framerate.den - 1) / enc_ctx->framerate.den;
+        enc_ctx->keyint_min = enc_ctx->gop_size;
+        av_dict_set(opts, "x264-params", "scenecut=0", 0);
+    }
+    if (encode_param->vbv_maxrate <= 0) {
+        enc_ctx->rc_max_rate = enc_ctx->bit_rate;
+        enc_ctx->rc_buffer_size = enc_ctx->bit_rate / 2;
+    }
 }
 
-int open_input_file(const char *filename, AVFormatContext **ifmt_ctx, StreamContext **stream_ctx) {
+/**
+ * RC_AUTO: pick CRF and VBV cap from the input's complexity. The analysis is
+ * kept in a sidecar, so only the first rendition of a file pays for it.
+ */
+static void apply_content_aware_rate(const char *filename, EncodeParam *param) {
+    ComplexityStats stats;
+    RateChoice choice;
+    int64_t t0 = av_gettime_relative();
     int ret;
+
+    if ((ret = analyze_load(filename, &stats)) < 0) {
+        if ((ret = analyze_complexity(filename, ANALYZE_MAX_SECONDS, &stats)) < 0) {
+            WARNING_LOG("complexity analysis of %s failed, keeping %d bit/s: %s\n",
+                filename, param->vbitrate, av_err2str(ret));
+            return;
+        }
+        analyze_save(filename, &stats);
+        INFO_LOG("analysed %0.1fs of %s in %0.3fs\n", stats.duration, filename,
+            (av_gettime_relative() - t0) / 1000000.0);
+    }
+    analyze_choose_rate(&stats, param->vbitrate, &choice);
+    if (param->crf <= 0)
+        param->crf = choice.crf;
+    if (param->vbv_maxrate <= 0) {
+        param->vbv_maxrate = choice.maxrate;
+        param->vbv_bufsize = choice.bufsize;
+    }
+    INFO_LOG("spatial=%0.2f temporal=%0.2f peak=%0.2f scenes=%d: crf=%0.1f maxrate=%d\n",
+        stats.spatial, stats.temporal, stats.peak_temporal, stats.scene_changes,
+        param->crf, param->vbv_maxrate);
+}
+
+/**
+ * Track selection for one stream. spec is a comma separated list of
+ * indexes counted per media type ("0", "1"), language tags ("eng") or
+ * "all"; "none" selects nothing and an empty spec the best track.
+ */
+static int select_stream(const AVFormatContext *ifmt_ctx, unsigned int index, const char *spec, int best) {
+    const AVStream *stream = ifmt_ctx->streams[index];
+    const AVDictionaryEntry *lang = av_dict_get(stream->metadata, "language", NULL, 0);
+    char entry[32];
     unsigned int i;
+    int nth = 0;
+    size_t len;
+
+    if (spec[0] == '\0')
+        return (int)index == best;
+    for (i = 0; i < index; i++) {
+        if (ifmt_ctx->streams[i]->codecpar->codec_type == stream->codecpar->codec_type)
+            nth++;
+    }
+    while (*spec) {
+        len = strcspn(spec, ",");
+        snprintf(entry, sizeof(entry), "%.*s", (int)FFMIN(len, sizeof(entry) - 1), spec);
+        spec += len + (spec[len] == ',');
+        if (!strcmp(entry, "all"))
+            return 1;
+        if (entry[0] >= '0' && entry[0] <= '9' ? atoi(entry) == nth
+            : lang != NULL && !av_strcasecmp(lang->value, entry))
+            return 1;
+    }
+    return 0;
+}
+
+/** Anything with a protocol other than file: is treated as a live source. */
+static int is_live_input(const char *filename) {
+    const char *p = strstr(filename, "://");
+    return p != NULL && strncmp(filename, "file:", 5) != 0;
+}
+
+/** Demuxer/protocol options for live inputs: short probing and reconnect. */
+static void live_input_options(const EncodeParam *encode_param, const char *filename, AVDictionary **opts) {
+    av_dict_set(opts, "fflags", "nobuffer", 0);
+    av_dict_set(opts, "probesize", "262144", 0);
+    av_dict_set(opts, "analyzeduration", "1000000", 0);
+    av_dict_set(opts, "rw_timeout", "5000000", 0);
+    if (!strncmp(filename, "http://", 7) || !strncmp(filename, "https://", 8)) {
+        av_dict_set(opts, "reconnect", "1", 0);
+        av_dict_set(opts, "reconnect_streamed", "1", 0);
+        av_dict_set(opts, "reconnect_delay_max", "5", 0);
+    }else if (!strncmp(filename, "udp://", 6)) {
+        av_dict_set(opts, "overrun_nonfatal", "1", 0);
+        av_dict_set(opts, "fifo_size", "278876", 0);
+        av_dict_set(opts, "timeout", "5000000", 0);
+    }else if (!strncmp(filename, "rtmp://", 7)) {
+        av_dict_set(opts, "rtmp_live", "live", 0);
+    }
+    if (encode_param->wallclock_timestamps)
+        av_dict_set(opts, "use_wallclock_as_timestamps", "1", 0);
+}
+
+static int open_input_format(const EncodeParam *encode_param, const char *filename, AVFormatContext **ifmt_ctx) {
+    AVDictionary *opts = NULL;
+    AVIOContext *pb = NULL;
+    int64_t budget = memory_share(MEMORY_SHARE_DEMUX);
+    int ret;
 
-    if((ret = avformat_open_input(ifmt_ctx, filename, NULL, NULL)) < 0) {
+    if (is_live_input(filename)) {
+        live_input_options(encode_param, filename, &opts);
+    }else if (mmap_io_open(filename, &pb) == 0) {
+        /* local files are read through a shared mapping, see mmap_io.c */
+        *ifmt_ctx = avformat_alloc_context();
+        if (!*ifmt_ctx) {
+            mmap_io_close(&pb);
+            return AVERROR(ENOMEM);
+        }
+        (*ifmt_ctx)->pb = pb;
+        (*ifmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    if (budget > 0) {
+        /* probing buffers up to probesize; the index is capped per stream */
+        av_dict_set_int(&opts, "probesize", FFMIN(DEFAULT_PROBESIZE, budget / 2), AV_DICT_DONT_OVERWRITE);
+        av_dict_set_int(&opts, "indexmem", FFMIN(DEFAULT_INDEXMEM, budget / 4), 0);
+    }
+
+    ret = avformat_open_input(ifmt_ctx, filename, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        /* avformat_open_input freed the context but not a custom pb */
+        mmap_io_close(&pb);
         ERROR_LOG("avformat_open_input error: %s '%s'!\n", av_err2str(ret), filename);
         return ret;
     }
+    return 0;
+}
+
+static void close_input_format(AVFormatContext **ifmt_ctx) {
+    AVIOContext *pb = NULL;
+
+    if (*ifmt_ctx && ((*ifmt_ctx)->flags & AVFMT_FLAG_CUSTOM_IO))
+        pb = (*ifmt_ctx)->pb;
+    avformat_close_input(ifmt_ctx);
+    mmap_io_close(&pb);
+}
+
+int open_input_file(TransSession *session, const char *filename) {
+    AVFormatContext **ifmt_ctx = &session->ifmt_ctx;
+    StreamContext **stream_ctx = &session->stream_ctx;
+    int ret, best_video, best_audio;
+    unsigned int i;
+
+    if ((ret = open_input_format(session->param, filename, ifmt_ctx)) < 0)
+        return ret;
 
     if ((ret = avformat_find_stream_info(*ifmt_ctx, NULL)) < 0) {
         ERROR_LOG("avformat_find_stream error: %s!\n", av_err2str(ret));
@@ -45,77 +295,227 @@ int open_input_file(const char *filename, AVFormatContext **ifmt_ctx, StreamCont
     if (!*stream_ctx)
         return AVERROR(ENOMEM);
 
+    best_video = av_find_best_stream(*ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    best_audio = av_find_best_stream(*ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, best_video, NULL, 0);
+
     for (i = 0; i < (*ifmt_ctx)->nb_streams; i++) {
         AVStream *stream = (*ifmt_ctx)->streams[i];
-        AVCodec *dec = avcodec_find_decoder(stream->codecpar->codec_id);
+        AVCodec *dec;
         AVCodecContext *codec_ctx;
+
+        (*stream_ctx)[i].out_index = -1;
+        /* subtitles and data are never decoded; open_output_file remuxes or drops them */
+        if (stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO
+            && stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+            continue;
+        /* unselected tracks get no decoder, and so no encoder either */
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO
+            ? !select_stream(*ifmt_ctx, i, session->param->video_tracks, best_video)
+            : !select_stream(*ifmt_ctx, i, session->param->audio_tracks, best_audio))
+            continue;
+
+        codec_pool_key_from_decoder(&(*stream_ctx)[i].dec_key, stream->codecpar);
+        codec_ctx = codec_pool_get(&(*stream_ctx)[i].dec_key);
+        if (codec_ctx) {
+            DEBUG_LOG("reuse pooled decoder for stream #%u\n", i);
+            if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+                codec_ctx->framerate = av_guess_frame_rate(*ifmt_ctx, stream, NULL);
+            (*stream_ctx)[i].dec_ctx = codec_ctx;
+            continue;
+        }
+        dec = avcodec_find_decoder(stream->codecpar->codec_id);
         if (!dec) {
-            ERROR_LOG("Failed to find decoder for stream #%u: %s!\n", i, av_err2str(ret));
-            return AVERROR_DECODER_NOT_FOUND;
+            WARNING_LOG("no decoder for stream #%u (%s), dropping it\n", i,
+                avcodec_get_name(stream->codecpar->codec_id));
+            continue;
         }
         codec_ctx = avcodec_alloc_context3(dec);
         if (!codec_ctx) {
             av_log(NULL, AV_LOG_ERROR, "Failed to allocate the decoder context for stream #%u: %s!\n", i, av_err2str(ret));
             return AVERROR(ENOMEM);
         }
+        (*stream_ctx)[i].dec_ctx = codec_ctx;
         ret = avcodec_parameters_to_context(codec_ctx, stream->codecpar);
         if (ret < 0) {
             ERROR_LOG("Failed to copy decoder parameters to input decoder context "
                 "for stream #%u: %s!\n", i, av_err2str(ret));
             return ret;
         }
-        /* Reencode video & audio and remux subtitles etc. */
-        if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO
-            || codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-            if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
-                codec_ctx->framerate = av_guess_frame_rate(ifmt_ctx, stream, NULL);
-            /* Open decoder */
-            ret = avcodec_open2(codec_ctx, dec, NULL);
-            if (ret < 0) {
-                ERROR_LOG("Failed to open decoder for stream #%u: %s!\n", i, av_err2str(ret));
-                return ret;
-            }
+        if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+            codec_ctx->framerate = av_guess_frame_rate(*ifmt_ctx, stream, NULL);
+        /* Open decoder */
+        ret = avcodec_open2(codec_ctx, dec, NULL);
+        if (ret < 0) {
+            ERROR_LOG("Failed to open decoder for stream #%u: %s!\n", i, av_err2str(ret));
+            return ret;
         }
-        (*stream_ctx)[i].dec_ctx = codec_ctx;
     }
 
+    session->memory.demux = (*ifmt_ctx)->probesize + (int64_t)(*ifmt_ctx)->max_index_size * (*ifmt_ctx)->nb_streams;
+    for (i = 0; i < (*ifmt_ctx)->nb_streams; i++) {
+        AVCodecParameters *par = (*ifmt_ctx)->streams[i]->codecpar;
+        AVCodecContext *codec_ctx = (*stream_ctx)[i].dec_ctx;
+
+        /* a picture in each frame thread, the reorder delay and the references */
+        if (codec_ctx && par->codec_type == AVMEDIA_TYPE_VIDEO && par->format >= 0)
+            session->memory.frames += (int64_t)FFMAX(av_image_get_buffer_size(par->format, par->width, par->height, 1), 0)
+                * (FFMAX(codec_ctx->thread_count, 1) + par->video_delay + DECODER_REFERENCE_PICTURES);
+    }
+    if (memory_share(MEMORY_SHARE_FRAMES) > 0 && session->memory.frames > memory_share(MEMORY_SHARE_FRAMES))
+        WARNING_LOG("decoding needs about %"PRId64"K, over the %"PRId64"K budget for frames\n",
+            session->memory.frames / 1024, memory_share(MEMORY_SHARE_FRAMES) / 1024);
+
     av_dump_format(*ifmt_ctx, 0, filename, 0);
 
     return 0;
 }
 
-void init_ffmpeg() {
+static void init_ffmpeg_once() {
     avfilter_register_all();
     av_register_all();
-    return;
 }
 
-int open_output_file(const char *filename, const AVFormatContext *ifmt_ctx, AVFormatContext **ofmt_ctx, StreamContext **stream_ctx) {
+void init_ffmpeg() {
+    pthread_once(&ffmpeg_once, init_ffmpeg_once);
+}
+
+/**
+ * x264 holds about lookahead + references + one picture per frame thread.
+ * Fit them into the encoder's share, shortening the lookahead before
+ * taking threads away.
+ */
+static void apply_encoder_memory(TransSession *session, AVCodecContext *enc_ctx, AVDictionary **opts) {
+    SessionMemory *memory = &session->memory;
+    int64_t picture = (int64_t)enc_ctx->width * enc_ctx->height * X264_PICTURE_FACTOR;
+    int64_t budget = memory_share(MEMORY_SHARE_ENCODER);
+    int threads = enc_ctx->thread_count > 0 ? enc_ctx->thread_count
+        : FFMIN(av_cpu_count() * 3 / 2, X264_MAX_AUTO_THREADS);
+    /* zerolatency has no lookahead */
+    int lookahead = session->param->profile == PROFILE_LOW_LATENCY ? 0 : X264_DEFAULT_LOOKAHEAD;
+    int frames;
+
+    if (budget > 0 && picture > 0) {
+        frames = budget / picture;
+        if (frames < lookahead + X264_DEFAULT_REFS + threads) {
+            lookahead = av_clip(frames - X264_DEFAULT_REFS - threads, FFMIN(lookahead, X264_MIN_LOOKAHEAD), lookahead);
+            threads = av_clip(frames - X264_DEFAULT_REFS - lookahead, 1, threads);
+            enc_ctx->thread_count = threads;
+            if (session->param->profile != PROFILE_LOW_LATENCY)
+                av_dict_set_int(opts, "rc-lookahead", lookahead, 0);
+        }
+    }
+    memory->lookahead = lookahead;
+    memory->encoder_threads = threads;
+    memory->encoder = picture * (lookahead + X264_DEFAULT_REFS + threads);
+}
+
+/* the interleave queue holds up to max_interleave_delta of every stream */
+static void apply_mux_memory(TransSession *session) {
+    SessionMemory *memory = &session->memory;
+    int64_t budget = memory_share(MEMORY_SHARE_MUX);
+    int64_t bit_rate = 0, delta = MAX_INTERLEAVE_DELTA;
+    const AVCodecContext *enc_ctx;
+    unsigned int i;
+
+    for (i = 0; i < session->ifmt_ctx->nb_streams; i++) {
+        if ((enc_ctx = session->stream_ctx[i].enc_ctx) != NULL)
+            bit_rate += enc_ctx->rc_max_rate > 0 ? enc_ctx->rc_max_rate : enc_ctx->bit_rate;
+        else if (session->stream_ctx[i].remux)
+            bit_rate += session->ifmt_ctx->streams[i]->codecpar->bit_rate;
+    }
+    /* CRF without a VBV cap: the source rate is the likelier bound */
+    if (bit_rate <= 0)
+        bit_rate = session->ifmt_ctx->bit_rate > 0 ? session->ifmt_ctx->bit_rate : FALLBACK_BIT_RATE;
+    if (budget > 0) {
+        delta = av_clip64(budget * 8 * AV_TIME_BASE / bit_rate, MIN_INTERLEAVE_DELTA, MAX_INTERLEAVE_DELTA);
+        session->ofmt_ctx->max_interleave_delta = delta;
+    }
+    memory->interleave_delta = delta;
+    memory->mux = bit_rate / 8 * delta / AV_TIME_BASE;
+}
+
+/* VmHWM: in a spawned session, the peak of that session's process; prefork workers reset it per session */
+static int64_t peak_rss() {
+    char line[128];
+    long long kb = -1;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/status", "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmHWM: %lld kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+static void log_session_memory(const TransSession *session) {
+    const SessionMemory *memory = &session->memory;
+    int64_t total = memory->demux + memory->frames + memory->encoder + memory->mux;
+    char budget[32] = "none";
+
+    if (session_memory_limit > 0)
+        snprintf(budget, sizeof(budget), "%"PRId64"M", session_memory_limit >> 20);
+    INFO_LOG("memory: demux %"PRId64"K, frames %"PRId64"K, encoder %"PRId64"K (lookahead %d, %d threads), "
+        "mux %"PRId64"K (interleave %0.1fs); %"PRId64"M planned, budget %s, peak RSS %"PRId64"M\n",
+        memory->demux / 1024, memory->frames / 1024, memory->encoder / 1024, memory->lookahead,
+        memory->encoder_threads, memory->mux / 1024, memory->interleave_delta / 1000000.0,
+        total >> 20, budget, peak_rss() >> 20);
+}
+
+int open_output_file(TransSession *session, const char *filename) {
+    const EncodeParam *encode_param = session->param;
+    const AVFormatContext *ifmt_ctx = session->ifmt_ctx;
+    AVFormatContext **ofmt_ctx = &session->ofmt_ctx;
+    StreamContext **stream_ctx = &session->stream_ctx;
     AVStream *out_stream;
     AVStream *in_stream;
-    AVCodecContext *dec_ctx, *enc_ctx;
+    AVCodecContext *dec_ctx, *enc_ctx, *pooled_ctx;
     AVCodec *encoder;
+    enum AVMediaType type;
+    uint8_t *buffer;
     int ret;
     unsigned int i;
 
-    avformat_alloc_output_context2(ofmt_ctx, NULL, "mpegts", filename);
+    avformat_alloc_output_context2(ofmt_ctx, NULL, encode_param->output->muxer, filename);
     if (!*ofmt_ctx) {
         ERROR_LOG("Could not create output context: %s!\n", av_err2str(AVERROR_UNKNOWN));
         return AVERROR_UNKNOWN;
     }
 
+    if (encode_param->mux_max_delay > 0)
+        (*ofmt_ctx)->max_delay = encode_param->mux_max_delay;
+    if (encode_param->muxrate > 0)
+        av_opt_set_int((*ofmt_ctx)->priv_data, "muxrate", encode_param->muxrate, 0);
+    if (encode_param->profile == PROFILE_LOW_LATENCY) {
+        /* push every packet through the pipe instead of filling the avio buffer */
+        (*ofmt_ctx)->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        if (encode_param->mux_max_delay <= 0)
+            (*ofmt_ctx)->max_delay = 100000;
+    }
+
     for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        in_stream = ifmt_ctx->streams[i];
+        dec_ctx = (*stream_ctx)[i].dec_ctx;
+        type = in_stream->codecpar->codec_type;
+
+        if ((type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO) ? !dec_ctx
+            : !encode_param->passthrough || !can_remux((*ofmt_ctx)->oformat, in_stream->codecpar->codec_id)) {
+            INFO_LOG("dropping %s stream #%u (%s)\n", av_get_media_type_string(type) ? av_get_media_type_string(type) : "unknown",
+                i, avcodec_get_name(in_stream->codecpar->codec_id));
+            in_stream->discard = AVDISCARD_ALL;
+            continue;
+        }
+
         out_stream = avformat_new_stream(*ofmt_ctx, NULL);
         if (!out_stream) {
             ERROR_LOG("Failed allocating output stream %s!\n", av_err2str(AVERROR_UNKNOWN));
             return AVERROR_UNKNOWN;
         }
+        (*stream_ctx)[i].out_index = out_stream->index;
 
-
-        in_stream = ifmt_ctx->streams[i];
-        dec_ctx = (*stream_ctx)[i].dec_ctx;
-
-        if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO || dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        if (type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO) {
             // Set Option
             AVDictionary *param = 0;
 
@@ -124,8 +524,9 @@ int open_output_file(const char *filename, const AVFormatContext *ifmt_ctx, AVFo
                 //encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
                 encoder = avcodec_find_encoder_by_name("libx264");
             }else {
-                //encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
-                encoder = avcodec_find_encoder(dec_ctx->codec->id);
+                encoder = avcodec_find_encoder_by_name(encode_param->acoder);
+                if (encoder == NULL)
+                    encoder = avcodec_find_encoder(dec_ctx->codec->id);
             }
 
             if (encoder == NULL) {
@@ -140,28 +541,70 @@ int open_output_file(const char *filename, const AVFormatContext *ifmt_ctx, AVFo
             }
 
             if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-                enc_ctx->width = dec_ctx->width;
-                enc_ctx->height = dec_ctx->height;
+                if (session->clip.smart) {
+                    /* the edges are spliced onto copied GOPs, so they keep the source format */
+                    enc_ctx->width = dec_ctx->width;
+                    enc_ctx->height = dec_ctx->height;
+                }else {
+                    normalized_size(encode_param, dec_ctx->width, dec_ctx->height, &enc_ctx->width, &enc_ctx->height);
+                }
                 enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
                 if (encoder->pix_fmts) {
                     enc_ctx->pix_fmt = encoder->pix_fmts[0];
                 }
                 enc_ctx->time_base = dec_ctx->time_base;
+                enc_ctx->framerate = dec_ctx->framerate;
+                if (!session->clip.smart && encode_param->max_fps > 0 && dec_ctx->framerate.num > 0
+                    && av_cmp_q(dec_ctx->framerate, (AVRational) { encode_param->max_fps, 1 }) > 0) {
+                    /* the fps filter in init_filters emits frames in 1/max_fps */
+                    enc_ctx->framerate = (AVRational) { encode_param->max_fps, 1 };
+                    enc_ctx->time_base = (AVRational) { 1, encode_param->max_fps };
+                }
+                if (enc_ctx->width != dec_ctx->width || enc_ctx->framerate.num != dec_ctx->framerate.num
+                    || enc_ctx->framerate.den != dec_ctx->framerate.den)
+                    INFO_LOG("normalizing %dx%d@%d/%d to %dx%d@%d/%d\n", dec_ctx->width, dec_ctx->height,
+                        dec_ctx->framerate.num, dec_ctx->framerate.den, enc_ctx->width, enc_ctx->height,
+                        enc_ctx->framerate.num, enc_ctx->framerate.den);
                 enc_ctx->codec_id = encoder->id;
                 enc_ctx->codec_type = encoder->type;
                 enc_ctx->me_range = 16;
                 enc_ctx->qcompress = 0.6;
-                enc_ctx->bit_rate = 880000;
+                enc_ctx->bit_rate = encode_param->vbitrate;
+                if (encode_param->crf > 0) {
+                    char crf[16];
+                    snprintf(crf, sizeof(crf), "%0.1f", encode_param->crf);
+                    av_dict_set(&param, "crf", crf, 0);
+                    enc_ctx->bit_rate = 0;
+                }
                 //enc_ctx->qmin = 30;//决定文件大小，qmin越大，编码压缩率越高
                 //enc_ctx->qmax = 40;
                 enc_ctx->me_subpel_quality = 1;//决定编码速度，越小，编码速度越快
                 enc_ctx->has_b_frames = 0;
                 enc_ctx->max_b_frames = 0;
-                stream_video_index = i;
+                if (encode_param->gop_size > 0) {
+                    /* fixed GOP: no scene-cut keyframes between the regular ones */
+                    enc_ctx->gop_size = encode_param->gop_size;
+                    enc_ctx->keyint_min = encode_param->gop_size;
+                    av_dict_set(&param, "x264-params", "scenecut=0", 0);
+                }
+                if (encode_param->vbv_maxrate > 0) {
+                    enc_ctx->rc_max_rate = encode_param->vbv_maxrate;
+                    enc_ctx->rc_buffer_size = encode_param->vbv_bufsize > 0
+                        ? encode_param->vbv_bufsize : encode_param->vbv_maxrate / 2;
+                }
+                if (encode_param->intra_refresh)
+                    av_dict_set(&param, "intra-refresh", "1", 0);
+                if (encode_param->profile == PROFILE_LOW_LATENCY)
+                    apply_low_latency_profile(encode_param, enc_ctx, &param);
+                apply_encoder_memory(session, enc_ctx, &param);
+                /* the filtered picture on its way to the encoder */
+                session->memory.frames += FFMAX(av_image_get_buffer_size(enc_ctx->pix_fmt, enc_ctx->width, enc_ctx->height, 1), 0);
+                session->stream_video_index = i;
             }else {
                 
                 enc_ctx->sample_rate = dec_ctx->sample_rate;
-                enc_ctx->channel_layout = dec_ctx->channel_layout;
+                enc_ctx->channel_layout = dec_ctx->channel_layout
+                    ? dec_ctx->channel_layout : av_get_default_channel_layout(dec_ctx->channels);
                 enc_ctx->channels = av_get_channel_layout_nb_channels(enc_ctx->channel_layout);
                 if (encoder->sample_fmts) {
                     enc_ctx->sample_fmt = encoder->sample_fmts[0];
@@ -169,7 +612,8 @@ int open_output_file(const char *filename, const AVFormatContext *ifmt_ctx, AVFo
                 enc_ctx->time_base = (AVRational) { 1, enc_ctx->sample_rate };
                 enc_ctx->bit_rate = 64000;
                 enc_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
-                stream_audio_index = i;
+                if (session->stream_audio_index < 0)
+                    session->stream_audio_index = i;
             }
             
             //H.264
@@ -192,37 +636,64 @@ int open_output_file(const char *filename, const AVFormatContext *ifmt_ctx, AVFo
             av_opt_set_sample_fmt(ost->swr_ctx, "out_sample_fmt", c->sample_fmt, 0);
             */
 
-            ret = avcodec_open2(enc_ctx, encoder, &param);
-            if (ret < 0) {
-                ERROR_LOG("Cannot open video encoder for stream #%u: %s!\n", i,av_err2str(ret));
-                return ret;
+            /* must be set before opening, or the encoder emits no extradata */
+            if ((*ofmt_ctx)->oformat->flags & AVFMT_GLOBALHEADER)
+                enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+            codec_pool_key_from_encoder(&(*stream_ctx)[i].enc_key, enc_ctx, param);
+            pooled_ctx = codec_pool_get(&(*stream_ctx)[i].enc_key);
+            if (pooled_ctx) {
+                DEBUG_LOG("reuse pooled encoder for stream #%u\n", i);
+                avcodec_free_context(&enc_ctx);
+                enc_ctx = pooled_ctx;
+            }else {
+                ret = avcodec_open2(enc_ctx, encoder, &param);
+                if (ret < 0) {
+                    ERROR_LOG("Cannot open video encoder for stream #%u: %s!\n", i,av_err2str(ret));
+                    av_dict_free(&param);
+                    return ret;
+                }
             }
+            av_dict_free(&param);
             ret = avcodec_parameters_from_context(out_stream->codecpar, enc_ctx);
             if (ret < 0) {
                 ERROR_LOG("Failed to copy encoder parameters to output stream #%u: %s!\n", i, av_err2str(ret));
                 return ret;
             }
-            if ((*ofmt_ctx)->oformat->flags & AVFMT_GLOBALHEADER)
-                enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
             out_stream->time_base = in_stream->time_base;
             (*stream_ctx)[i].enc_ctx = enc_ctx;
-        }else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN) {
-            FATAL_LOG("Elementary stream #%d is of unknown type, cannot proceed: %s!\n", i, av_err2str(AVERROR_INVALIDDATA));
-            return AVERROR_INVALIDDATA;
         }else {
-            /* if this stream must be remuxed */
+            /* subtitles and data: copied packet by packet */
             ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
             if (ret < 0) {
                 ERROR_LOG("Copying parameters for stream #%u failed: %s!\n", i, av_err2str(ret));
                 return ret;
             }
+            out_stream->codecpar->codec_tag = 0;
             out_stream->time_base = in_stream->time_base;
+            av_dict_copy(&out_stream->metadata, in_stream->metadata, 0);
+            (*stream_ctx)[i].remux = 1;
         }
     }
+    if ((*ofmt_ctx)->nb_streams == 0) {
+        ERROR_LOG("no stream of the input can be transcoded!\n");
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+    apply_mux_memory(session);
     av_dump_format(*ofmt_ctx, 0, filename, 1);
 
-    if (!((*ofmt_ctx)->oformat->flags & AVFMT_NOFILE)) {
+    if (session->segments) {
+        /* segments go to the caller's buffers; cut_segment() splits them */
+        if ((buffer = av_malloc(SEGMENT_IO_BUFFER_SIZE)) == NULL)
+            return AVERROR(ENOMEM);
+        (*ofmt_ctx)->pb = avio_alloc_context(buffer, SEGMENT_IO_BUFFER_SIZE, 1, session->segments->opaque,
+            NULL, session->segments->write, NULL);
+        if (!(*ofmt_ctx)->pb) {
+            av_free(buffer);
+            return AVERROR(ENOMEM);
+        }
+    }else if (!((*ofmt_ctx)->oformat->flags & AVFMT_NOFILE)) {
         ret = avio_open(&(*ofmt_ctx)->pb, filename, AVIO_FLAG_WRITE);
         if (ret < 0) {
             ERROR_LOG( "Could not open output file '%s': %s!\n", filename, av_err2str(ret));
@@ -234,11 +705,17 @@ int open_output_file(const char *filename, const AVFormatContext *ifmt_ctx, AVFo
 }
 
 /** Write the header of the output file container. */
-static int write_output_file_header(AVFormatContext *output_format_context)
+static int write_output_file_header(TransSession *session)
 {
+    AVDictionary *opts = NULL;
     int error;
-    if ((error = avformat_write_header(output_format_context, NULL)) < 0) {
-        fprintf(stderr, "Could not write output file header (error '%s')\n",
+
+    if (session->param->output->mux_options)
+        av_dict_parse_string(&opts, session->param->output->mux_options, "=", ":", 0);
+    error = avformat_write_header(session->ofmt_ctx, &opts);
+    av_dict_free(&opts);
+    if (error < 0) {
+        ERROR_LOG("Could not write output file header (error '%s')\n",
                 av_err2str(error));
         return error;
     }
@@ -262,6 +739,8 @@ int init_filter(FilteringContext *fctx, AVCodecContext *dec_ctx, AVCodecContext
     }
 
     if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        /* also used by the scalers the graph inserts for pixel format conversion */
+        filter_graph->scale_sws_opts = av_strdup("flags=bilinear");
         buffersrc = avfilter_get_by_name("buffer");
         buffersink = avfilter_get_by_name("buffersink");
         if (!buffersrc || !buffersink) {
@@ -381,6 +860,11 @@ int init_filter(FilteringContext *fctx, AVCodecContext *dec_ctx, AVCodecContext
     if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
         goto end;
 
+    /* aac and friends take fixed size frames; let the sink cut them */
+    if (enc_ctx->codec_type == AVMEDIA_TYPE_AUDIO && enc_ctx->frame_size > 0
+        && !(enc_ctx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+        av_buffersink_set_frame_size(buffersink_ctx, enc_ctx->frame_size);
+
     /* Fill FilteringContext */
     fctx->buffersrc_ctx = buffersrc_ctx;
     fctx->buffersink_ctx = buffersink_ctx;
@@ -394,10 +878,15 @@ end:
     return ret;
 }
 
-int init_filters(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ctx, const StreamContext *stream_ctx, FilteringContext **filter_ctx) {
+int init_filters(TransSession *session) {
+    const AVFormatContext *ifmt_ctx = session->ifmt_ctx;
+    const StreamContext *stream_ctx = session->stream_ctx;
+    FilteringContext **filter_ctx = &session->filter_ctx;
+    AVCodecContext *dec_ctx, *enc_ctx;
     int ret;
     unsigned int i;
-    const char *filter_spec;
+    char filter_spec[512];
+    char fps[64], scale[64];
 
     *filter_ctx = av_malloc_array(ifmt_ctx->nb_streams, sizeof(**filter_ctx));
     if (!*filter_ctx) {
@@ -409,16 +898,32 @@ int init_filters(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ct
         (*filter_ctx)[i].buffersrc_ctx = NULL;
         (*filter_ctx)[i].buffersink_ctx = NULL;
         (*filter_ctx)[i].filter_graph = NULL;
-        if (!(ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO
-            || ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO))
-            continue;
-
-
-        if (ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-            //filter_spec = "null";
-            filter_spec = "movie=./build/logo.png[wm];[in][wm]overlay=5:5[out]"; /* passthrough (dummy) filter for video */
-        else
-            filter_spec = "anull"; /* passthrough (dummy) filter for audio */
+        if (!stream_ctx[i].enc_ctx)
+            continue; /* remuxed or dropped */
+
+
+        dec_ctx = stream_ctx[i].dec_ctx;
+        enc_ctx = stream_ctx[i].enc_ctx;
+        if (session->clip.smart && i == session->clip.video_index) {
+            /* no overlay: the copied GOPs in between have none either */
+            snprintf(filter_spec, sizeof(filter_spec), "null");
+        }else if (ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            /* normalize before the overlay: drop frames first, then scale what is left */
+            fps[0] = scale[0] = '\0';
+            if (session->param->decimate) {
+                /* the decimator caps the rate itself: fps would fill the gaps it leaves */
+                ret = decimate_init(&session->stream_ctx[i].decimate, dec_ctx->time_base, enc_ctx->time_base);
+                if (ret < 0)
+                    return ret;
+            }else if (av_cmp_q(enc_ctx->framerate, dec_ctx->framerate) != 0 && enc_ctx->framerate.num > 0)
+                snprintf(fps, sizeof(fps), "fps=%d/%d,", enc_ctx->framerate.num, enc_ctx->framerate.den);
+            if (enc_ctx->width != dec_ctx->width || enc_ctx->height != dec_ctx->height)
+                snprintf(scale, sizeof(scale), "scale=%d:%d:flags=bilinear,", enc_ctx->width, enc_ctx->height);
+            snprintf(filter_spec, sizeof(filter_spec),
+                "[in]%s%snull[v];movie=./build/logo.png[wm];[v][wm]overlay=5:5[out]", fps, scale);
+        }else {
+            snprintf(filter_spec, sizeof(filter_spec), "anull"); /* passthrough (dummy) filter for audio */
+        }
         ret = init_filter(&(*filter_ctx)[i], stream_ctx[i].dec_ctx, stream_ctx[i].enc_ctx, filter_spec);
         if (ret)
             return ret;
@@ -427,13 +932,65 @@ int init_filters(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ct
     return 0;
 }
 
-int encode_video(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ctx, const StreamContext *stream_ctx,
-    AVFrame *filt_frame, unsigned int stream_index, int *got_frame) {
+/** Segmented output: the segment a timestamp falls in. */
+static int segment_of(const TransSession *session, int64_t pts, AVRational time_base)
+{
+    int64_t t = av_rescale_q(pts, time_base, AV_TIME_BASE_Q) - session->segment_origin;
+
+    return t < 0 ? 0 : (int)(t / (int64_t)(session->segments->duration * AV_TIME_BASE));
+}
+
+/** Segmented output: make the first frame of every segment a keyframe. */
+static void force_segment_keyframe(TransSession *session, AVFrame *frame, AVRational time_base)
+{
+    if (frame->pts == AV_NOPTS_VALUE
+        || av_compare_ts(frame->pts, time_base, session->next_keyframe, AV_TIME_BASE_Q) < 0)
+        return;
+    frame->pict_type = AV_PICTURE_TYPE_I;
+    session->next_keyframe = session->segment_origin
+        + (segment_of(session, frame->pts, time_base) + 1) * (int64_t)(session->segments->duration * AV_TIME_BASE);
+}
+
+/**
+ * Segmented output: end the current segment before a keyframe of the next
+ * one. Everything queued for interleaving or buffered in the muxer is
+ * written first, so the new segment starts at the keyframe, with the PAT
+ * and PMT in front of it.
+ */
+static int cut_segment(TransSession *session, const AVPacket *pkt, AVRational time_base)
+{
+    const SegmentOutput *segments = session->segments;
+    int index, ret;
+
+    if (!(pkt->flags & AV_PKT_FLAG_KEY) || pkt->pts == AV_NOPTS_VALUE
+        || (index = segment_of(session, pkt->pts, time_base)) <= session->segment_index)
+        return 0;
+    av_interleaved_write_frame(session->ofmt_ctx, NULL);
+    av_write_frame(session->ofmt_ctx, NULL);
+    avio_flush(session->ofmt_ctx->pb);
+    if ((ret = session->ofmt_ctx->pb->error) < 0) {
+        session->stop = 1;
+        return ret;
+    }
+    /* segments without a keyframe of their own are ended empty */
+    for (; session->segment_index < index; session->segment_index++) {
+        if ((ret = segments->segment_end(segments->opaque, session->segment_index)) < 0) {
+            session->stop = 1;
+            return ret;
+        }
+    }
+    av_opt_set(session->ofmt_ctx->priv_data, "mpegts_flags", "+resend_headers", 0);
+    return 0;
+}
+
+int encode_video(TransSession *session, AVFrame *filt_frame, unsigned int stream_index, int *got_frame) {
     int ret;
     int got_frame_local;
     AVPacket enc_pkt;
+    int64_t t;
 
-    AVCodecContext *enc_ctx = stream_ctx[stream_index].enc_ctx;
+    AVFormatContext *ofmt_ctx = session->ofmt_ctx;
+    AVCodecContext *enc_ctx = session->stream_ctx[stream_index].enc_ctx;
 
     /* encode filtered frame */
     enc_pkt.data = NULL;
@@ -447,27 +1004,49 @@ int encode_video(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ct
         enc_ctx->time_base.num, enc_ctx->time_base.den, filt_frame->key_frame, filt_frame->pict_type);
     */
 
+    if (session->segments && filt_frame && stream_index == session->segment_stream)
+        force_segment_keyframe(session, filt_frame, enc_ctx->time_base);
+    t = TRACE_BEGIN();
     ret = avcodec_send_frame(enc_ctx, filt_frame);
+    TRACE_END("encode.send", stream_index, t);
     if (ret < 0) {
-        fprintf(stderr, "Error sending a frame for encoding\n");
+        ERROR_LOG("Error sending a frame for encoding\n");
         return ret;
     }
 
     while (ret >= 0) {
+        t = TRACE_BEGIN();
         ret = avcodec_receive_packet(enc_ctx, &enc_pkt);
+        TRACE_END("encode.receive", stream_index, t);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
             goto end;
         else if (ret < 0) {
-            fprintf(stderr, "Error during encoding\n");
+            ERROR_LOG("Error during encoding\n");
             goto end;
         }
-        enc_pkt.stream_index = stream_index;
-        av_packet_rescale_ts(&enc_pkt, enc_ctx->time_base, ofmt_ctx->streams[stream_index]->time_base);
+        enc_pkt.stream_index = session->stream_ctx[stream_index].out_index;
+        av_packet_rescale_ts(&enc_pkt, enc_ctx->time_base, ofmt_ctx->streams[enc_pkt.stream_index]->time_base);
+        if (session->clip.smart && session->clip.phase == CLIP_HEAD && enc_pkt.dts != AV_NOPTS_VALUE)
+            enc_pkt.dts -= av_rescale_q(session->clip.dts_shift, session->clip.time_base,
+                ofmt_ctx->streams[enc_pkt.stream_index]->time_base);
+        if (!session->first_packet_written) {
+            session->first_packet_written = 1;
+            INFO_LOG("latency: first video packet after %0.3fs\n",
+                (av_gettime_relative() - session->start_time) / 1000000.0);
+        }
+        if (session->segments && stream_index == session->segment_stream
+            && (ret = cut_segment(session, &enc_pkt, ofmt_ctx->streams[enc_pkt.stream_index]->time_base)) < 0)
+            goto end;
         //printf("Video %d => %d \n", enc_pkt.duration, enc_pkt.dts);
         //printf("Write packet %3"PRId64" (size=%5d)\n", enc_pkt.pts, enc_pkt.size);
+        t = TRACE_BEGIN();
         ret = av_interleaved_write_frame(ofmt_ctx, &enc_pkt);
+        TRACE_END("mux.write", stream_index, t);
         if (ret < 0) {
-            fprintf(stderr, "Error av_write_frame\n");
+            ERROR_LOG("Error av_write_frame\n");
+            /* avio keeps the first write error and drops every later write: the segments are lost */
+            if (session->segments)
+                session->stop = 1;
         }
         //fwrite(enc_pkt->data, 1, enc_pkt->size, outfile);
     }
@@ -479,13 +1058,14 @@ end:
 }
 
 
-int encode_audio(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ctx, const StreamContext *stream_ctx,
-    AVFrame *filt_frame, unsigned int stream_index, int *got_frame) {
+int encode_audio(TransSession *session, AVFrame *filt_frame, unsigned int stream_index, int *got_frame) {
     int ret;
     int got_frame_local;
     AVPacket enc_pkt;
+    int64_t t;
 
-    AVCodecContext *enc_ctx = stream_ctx[stream_index].enc_ctx;
+    AVFormatContext *ofmt_ctx = session->ofmt_ctx;
+    AVCodecContext *enc_ctx = session->stream_ctx[stream_index].enc_ctx;
 
     /* encode filtered frame */
     enc_pkt.data = NULL;
@@ -497,34 +1077,47 @@ int encode_audio(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ct
     av_ts2str(filt_frame->pts), av_ts2timestr(filt_frame->pts, &enc_ctx->time_base),
     enc_ctx->time_base.num, enc_ctx->time_base.den);*/
 
+    t = TRACE_BEGIN();
     ret = avcodec_send_frame(enc_ctx, filt_frame);
+    TRACE_END("encode.send", stream_index, t);
     if (ret < 0) {
-        fprintf(stderr, "Error sending a frame for encoding\n");
+        ERROR_LOG("Error sending a frame for encoding\n");
         return ret; 
     }
 
     /* read all the available output packets (in general there may be any
     * number of them */
     while (ret >= 0) {
+        t = TRACE_BEGIN();
         ret = avcodec_receive_packet(enc_ctx, &enc_pkt);
+        TRACE_END("encode.receive", stream_index, t);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
             return ret;
         }
         else if (ret < 0) {
-            fprintf(stderr, "Error encoding audio frame\n");
+            ERROR_LOG("Error encoding audio frame\n");
             return ret;
         }
-        enc_pkt.stream_index = stream_index;
-        av_packet_rescale_ts(&enc_pkt, enc_ctx->time_base, ofmt_ctx->streams[stream_index]->time_base);
+        enc_pkt.stream_index = session->stream_ctx[stream_index].out_index;
+        av_packet_rescale_ts(&enc_pkt, enc_ctx->time_base, ofmt_ctx->streams[enc_pkt.stream_index]->time_base);
 
         /*av_log(NULL, AV_LOG_INFO, "encoder -> type:audio "
             "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
             av_ts2str(enc_pkt.pts), av_ts2timestr(enc_pkt.pts, &enc_ctx->time_base),
             av_ts2str(enc_pkt.dts), av_ts2timestr(enc_pkt.dts, &enc_ctx->time_base));*/
 
+        if (session->segments && stream_index == session->segment_stream
+            && (ret = cut_segment(session, &enc_pkt, ofmt_ctx->streams[enc_pkt.stream_index]->time_base)) < 0) {
+            av_packet_unref(&enc_pkt);
+            return ret;
+        }
+        t = TRACE_BEGIN();
         ret = av_interleaved_write_frame(ofmt_ctx, &enc_pkt);
+        TRACE_END("mux.write", stream_index, t);
         if (ret < 0) {
-            fprintf(stderr, "Error audio av_write_frame\n");
+            ERROR_LOG("Error audio av_write_frame\n");
+            if (session->segments)
+                session->stop = 1;
         }
 
         av_packet_unref(&enc_pkt);
@@ -533,23 +1126,27 @@ int encode_audio(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ct
     return 0;
 }
 
-int encode_write_frame(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ctx, const StreamContext *stream_ctx,
-    AVFrame *filt_frame, unsigned int stream_index, int *got_frame) {
-    if (ifmt_ctx->streams[stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-        return encode_audio(ifmt_ctx, ofmt_ctx, stream_ctx, filt_frame, stream_index, got_frame);
+int encode_write_frame(TransSession *session, AVFrame *filt_frame, unsigned int stream_index, int *got_frame) {
+    if (session->ifmt_ctx->streams[stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+        return encode_audio(session, filt_frame, stream_index, got_frame);
     }else {
-        return encode_video(ifmt_ctx, ofmt_ctx, stream_ctx, filt_frame, stream_index, got_frame);
+        return encode_video(session, filt_frame, stream_index, got_frame);
     }
 }
 
-int filter_encode_write_frame(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ctx, const StreamContext *stream_ctx, 
-    const FilteringContext *filter_ctx, AVFrame *frame, unsigned int stream_index) {
+int filter_encode_write_frame(TransSession *session, AVFrame *frame, unsigned int stream_index) {
+    const FilteringContext *filter_ctx = session->filter_ctx;
+    AVCodecContext *enc_ctx = session->stream_ctx[stream_index].enc_ctx;
+    AVRational sink_time_base;
     int ret;
+    int64_t t;
     AVFrame *filt_frame;
 
     DEBUG_LOG("Pushing decoded frame to filters!\n");
     
+    t = TRACE_BEGIN();
     ret = av_buffersrc_add_frame_flags(filter_ctx[stream_index].buffersrc_ctx, frame, 0);
+    TRACE_END("filter.push", stream_index, t);
     if (ret < 0) {
         ERROR_LOG("Error while feeding the filtergraph,%s,frame exist is %d\n", av_err2str(ret), frame != NULL);
         return ret;
@@ -563,7 +1160,9 @@ int filter_encode_write_frame(const AVFormatContext *ifmt_ctx, const AVFormatCon
         }
         
         DEBUG_LOG("Pulling filtered frame from filters!\n");
+        t = TRACE_BEGIN();
         ret = av_buffersink_get_frame(filter_ctx[stream_index].buffersink_ctx, filt_frame);
+        TRACE_END("filter.pull", stream_index, t);
         if (ret < 0) {
             /* if no more frames for output - returns AVERROR(EAGAIN)
             * if flushed and no more frames for output - returns AVERROR_EOF
@@ -575,7 +1174,11 @@ int filter_encode_write_frame(const AVFormatContext *ifmt_ctx, const AVFormatCon
             break;
         }
         filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
-        ret = encode_write_frame(ifmt_ctx, ofmt_ctx, stream_ctx, filt_frame, stream_index, NULL);
+        /* fps changes the time base inside the graph */
+        sink_time_base = filter_ctx[stream_index].buffersink_ctx->inputs[0]->time_base;
+        if (filt_frame->pts != AV_NOPTS_VALUE)
+            filt_frame->pts = av_rescale_q(filt_frame->pts, sink_time_base, enc_ctx->time_base);
+        ret = encode_write_frame(session, filt_frame, stream_index, NULL);
         av_frame_free(&filt_frame);
         if (ret < 0)
             break;
@@ -584,35 +1187,55 @@ int filter_encode_write_frame(const AVFormatContext *ifmt_ctx, const AVFormatCon
     return 0;
 }
 
-static int flush_encoder(const AVFormatContext *ifmt_ctx, const AVFormatContext *ofmt_ctx, const StreamContext *stream_ctx, unsigned int stream_index)
+static int flush_encoder(TransSession *session, unsigned int stream_index)
 {
     int ret;
-    int got_frame;
 
-    if (!(stream_ctx[stream_index].enc_ctx->codec->capabilities &
+    if (!(session->stream_ctx[stream_index].enc_ctx->codec->capabilities &
         AV_CODEC_CAP_DELAY))
         return 0;
 
-    while (1) {
-        DEBUG_LOG("Flushing stream #%u encoder\n", stream_index);
-        ret = encode_write_frame(ifmt_ctx, ofmt_ctx, stream_ctx, NULL, stream_index, &got_frame);
-        if (ret < 0)
-            break;
-        if (!got_frame)
+    /* a NULL frame drains the encoder; EOF means every packet was written */
+    DEBUG_LOG("Flushing stream #%u encoder\n", stream_index);
+    ret = encode_write_frame(session, NULL, stream_index, NULL);
+    return ret == AVERROR_EOF || ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+/** Clips: drop frames outside [start, end), and in smart mode those the copied GOPs cover. */
+static int clip_keep_frame(TransSession *session, unsigned int stream_index, const AVFrame *frame)
+{
+    ClipContext *clip = &session->clip;
+    AVRational time_base = session->stream_ctx[stream_index].dec_ctx->time_base;
+
+    if (!clip->enabled || frame->pts == AV_NOPTS_VALUE)
+        return 1;
+    if (av_compare_ts(frame->pts, time_base, clip->start, AV_TIME_BASE_Q) < 0
+        || av_compare_ts(frame->pts, time_base, clip->end, AV_TIME_BASE_Q) >= 0)
+        return 0;
+    if (clip->smart && stream_index == clip->video_index) {
+        if (clip->phase == CLIP_HEAD
+            && av_compare_ts(frame->pts, time_base, clip->copy_start, clip->time_base) >= 0)
+            return 0;
+        if (clip->phase == CLIP_TAIL
+            && av_compare_ts(frame->pts, time_base, clip->copy_end, clip->time_base) < 0)
             return 0;
+        clip->encoded_frames++;
     }
-    return ret;
+    return 1;
 }
 
-static int decode_video(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, StreamContext *stream_ctx, FilteringContext *filter_ctx, AVFrame *frame, AVPacket *packet)
+static int decode_video(TransSession *session, AVFrame *frame, AVPacket *packet)
 {
     int ret, stream_index;
     AVCodecContext *dec_ctx, *enc_ctx;
+    int64_t t;
     stream_index = packet->stream_index;
-    dec_ctx = stream_ctx[stream_index].dec_ctx;
-    enc_ctx = stream_ctx[stream_index].enc_ctx;
+    dec_ctx = session->stream_ctx[stream_index].dec_ctx;
+    enc_ctx = session->stream_ctx[stream_index].enc_ctx;
 
+    t = TRACE_BEGIN();
     ret = avcodec_send_packet(dec_ctx, packet);
+    TRACE_END("decode.send", stream_index, t);
     if (ret < 0 && ret != AVERROR_EOF) {
         ERROR_LOG("avcodec_send_packet fail %d\n", ret);
         return ret;
@@ -620,15 +1243,15 @@ static int decode_video(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, St
 
     while (ret >= 0) {
         
+        t = TRACE_BEGIN();
         ret = avcodec_receive_frame(dec_ctx, frame);
+        TRACE_END("decode.receive", stream_index, t);
 
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            av_frame_free(&frame);
             break;
         }
         else if (ret < 0) {
             av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
-            av_frame_free(&frame);
             goto end;
         }
 
@@ -638,14 +1261,19 @@ static int decode_video(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, St
             
             //frame->pts = frame->best_effort_timestamp;  
             frame->pts = av_frame_get_best_effort_timestamp(frame);
-            ret = filter_encode_write_frame(ifmt_ctx, ofmt_ctx, stream_ctx, filter_ctx, frame, stream_index);
-            av_frame_free(&frame);
+            if (!clip_keep_frame(session, stream_index, frame)
+                || decimate_frame(&session->stream_ctx[stream_index].decimate, frame) > 0) {
+                av_frame_unref(frame);
+                continue;
+            }
+            ret = filter_encode_write_frame(session, frame, stream_index);
+            av_frame_unref(frame);
             if (ret < 0) {
                 goto end;
             }
         }
         else {
-            av_frame_free(&frame);
+            av_frame_unref(frame);
         }
 
     }
@@ -656,15 +1284,18 @@ end:
     return 0;
 }
 
-static int decode_audio(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, StreamContext *stream_ctx, FilteringContext *filter_ctx, AVFrame *frame, AVPacket *packet)
+static int decode_audio(TransSession *session, AVFrame *frame, AVPacket *packet)
 {
     int ret, stream_index;
     AVCodecContext *dec_ctx, *enc_ctx;
+    int64_t t;
     stream_index = packet->stream_index;
-    dec_ctx = stream_ctx[stream_index].dec_ctx;
-    enc_ctx = stream_ctx[stream_index].enc_ctx;
+    dec_ctx = session->stream_ctx[stream_index].dec_ctx;
+    enc_ctx = session->stream_ctx[stream_index].enc_ctx;
 
+    t = TRACE_BEGIN();
     ret = avcodec_send_packet(dec_ctx, packet);
+    TRACE_END("decode.send", stream_index, t);
     if (ret < 0 && ret != AVERROR_EOF) {
         ERROR_LOG("avcodec_send_packet fail %d\n", ret);
         return ret;
@@ -672,7 +1303,9 @@ static int decode_audio(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, St
 
     while (ret >= 0) {
         
+        t = TRACE_BEGIN();
         ret = avcodec_receive_frame(dec_ctx, frame);
+        TRACE_END("decode.receive", stream_index, t);
 
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
             break;
@@ -688,14 +1321,18 @@ static int decode_audio(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, St
             
             //frame->pts = frame->best_effort_timestamp;  
             frame->pts = av_frame_get_best_effort_timestamp(frame);
-            ret = filter_encode_write_frame(ifmt_ctx, ofmt_ctx, stream_ctx, filter_ctx, frame, stream_index);
-            av_frame_free(&frame);
+            if (!clip_keep_frame(session, stream_index, frame)) {
+                av_frame_unref(frame);
+                continue;
+            }
+            ret = filter_encode_write_frame(session, frame, stream_index);
+            av_frame_unref(frame);
             if (ret < 0) {
                 goto end;
             }
         }
         else {
-            av_frame_free(&frame);
+            av_frame_unref(frame);
         }
 
     }
@@ -706,174 +1343,665 @@ end:
     return 0;
 }
 
-static int decode(AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, StreamContext *stream_ctx, FilteringContext *filter_ctx, AVFrame *frame, AVPacket *packet)
+/* frame is scratch space owned by the caller; it is left unreferenced */
+static int decode(TransSession *session, AVFrame *frame, AVPacket *packet)
 {
-    if (ifmt_ctx->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-        //return decode_audio(ifmt_ctx, ofmt_ctx, stream_ctx, filter_ctx, frame, packet);
+    if (session->ifmt_ctx->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+        return decode_audio(session, frame, packet);
     }else {
-        return decode_video(ifmt_ctx, ofmt_ctx, stream_ctx, filter_ctx, frame, packet);
+        return decode_video(session, frame, packet);
     }
+    return 0;
 }
 
-int create_trans_task(char *input_filename, char *output_filename) {
+/**
+ * Reopen a live input after a read error, keeping the decoders. The stream
+ * layout has to match the previous connection; timestamps are shifted so
+ * they continue where the old connection stopped.
+ */
+static int reconnect_live_input(TransSession *session, const char *filename) {
+    AVFormatContext **ifmt_ctx = &session->ifmt_ctx;
+    StreamContext *stream_ctx = session->stream_ctx;
+    AVFormatContext *new_ctx = NULL;
+    unsigned int i;
+    int attempt, ret;
 
-    int ret, i, j, thread_ret;
-    int got_frame = 0;
-    int ts = 0;
-    int thread_count = 5;
-    int start = 1;
-    int stream_index;
-    int index = 0;
-    AVFormatContext *ifmt_ctx = NULL;
-    AVFormatContext *ofmt_ctx = NULL;
-    StreamContext *stream_ctx = NULL;
-    FilteringContext *filter_ctx = NULL;
-    SwrContext *resample_context = NULL;
-    AVAudioFifo *fifo = NULL;
+    for (attempt = 1; attempt <= LIVE_RECONNECT_ATTEMPTS; attempt++) {
+        av_usleep(FFMIN(attempt * 500000, 5000000));
+        WARNING_LOG("reconnecting live input '%s', attempt %d\n", filename, attempt);
+        if ((ret = open_input_format(session->param, filename, &new_ctx)) < 0)
+            continue;
+        if ((ret = avformat_find_stream_info(new_ctx, NULL)) < 0) {
+            avformat_close_input(&new_ctx);
+            continue;
+        }
+        for (i = 0; i < new_ctx->nb_streams && i < (*ifmt_ctx)->nb_streams; i++) {
+            if (new_ctx->streams[i]->codecpar->codec_id != (*ifmt_ctx)->streams[i]->codecpar->codec_id)
+                break;
+        }
+        if (new_ctx->nb_streams != (*ifmt_ctx)->nb_streams || i < new_ctx->nb_streams) {
+            ERROR_LOG("live input '%s' changed its stream layout!\n", filename);
+            avformat_close_input(&new_ctx);
+            return AVERROR_INVALIDDATA;
+        }
+
+        close_input_format(ifmt_ctx);
+        *ifmt_ctx = new_ctx;
+        for (i = 0; i < new_ctx->nb_streams; i++) {
+            if (stream_ctx[i].dec_ctx && avcodec_is_open(stream_ctx[i].dec_ctx))
+                avcodec_flush_buffers(stream_ctx[i].dec_ctx);
+            stream_ctx[i].resync = 1;
+        }
+        INFO_LOG("live input '%s' reconnected\n", filename);
+        return 0;
+    }
+    ERROR_LOG("live input '%s' did not come back after %d attempts!\n", filename, LIVE_RECONNECT_ATTEMPTS);
+    return AVERROR(EIO);
+}
+
+/** Keep timestamps of a live input monotonic across reconnects (decoder time base). */
+static void fix_live_timestamps(const EncodeParam *encode_param, StreamContext *sctx, AVPacket *packet) {
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+    if (ts == AV_NOPTS_VALUE)
+        return;
+    if (sctx->resync) {
+        sctx->resync = 0;
+        if (!encode_param->wallclock_timestamps && sctx->next_dts != AV_NOPTS_VALUE)
+            sctx->ts_offset = sctx->next_dts - ts;
+    }
+    if (packet->pts != AV_NOPTS_VALUE)
+        packet->pts += sctx->ts_offset;
+    if (packet->dts != AV_NOPTS_VALUE)
+        packet->dts += sctx->ts_offset;
+    sctx->next_dts = ts + sctx->ts_offset + FFMAX(packet->duration, 1);
+}
+
+/**
+ * Position the input on the GOP containing start_time (seconds). With a
+ * keyframe sidecar the keyframe is known up front: try its byte offset,
+ * then its exact pts. Without one, leave it to the demuxer.
+ */
+static int seek_input(const char *filename, AVFormatContext *ifmt_ctx, double start_time) {
+    KeyframeIndex *index = NULL;
+    const KeyframeEntry *entry;
+    AVStream *stream;
+    int64_t ts;
+    int ret;
+
+    if (kfindex_load(filename, &index) < 0) {
+        ts = (int64_t)(start_time * AV_TIME_BASE);
+        if (ifmt_ctx->start_time != AV_NOPTS_VALUE)
+            ts += ifmt_ctx->start_time;
+        DEBUG_LOG("no keyframe index for '%s', demuxer seek\n", filename);
+        return av_seek_frame(ifmt_ctx, -1, ts, AVSEEK_FLAG_BACKWARD);
+    }
+
+    stream = ifmt_ctx->streams[index->stream_index];
+    ts = av_rescale_q((int64_t)(start_time * AV_TIME_BASE), AV_TIME_BASE_Q, index->time_base);
+    if (stream->start_time != AV_NOPTS_VALUE)
+        ts += av_rescale_q(stream->start_time, stream->time_base, index->time_base);
+    entry = kfindex_lookup(index, ts);
+    ret = AVERROR(EINVAL);
+    if (entry && entry->pos >= 0 && !(ifmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK))
+        ret = av_seek_frame(ifmt_ctx, -1, entry->pos, AVSEEK_FLAG_BYTE);
+    if (entry && ret < 0)
+        ret = av_seek_frame(ifmt_ctx, index->stream_index,
+            av_rescale_q(entry->pts, index->time_base, stream->time_base), AVSEEK_FLAG_BACKWARD);
+    if (ret >= 0)
+        DEBUG_LOG("seek to keyframe pts %"PRId64" pos %"PRId64"\n", entry->pts, entry->pos);
+    kfindex_free(&index);
+    return ret;
+}
+
+/**
+ * Set up a ?start=&end= clip. Smart rendering needs the keyframe sidecar,
+ * an H.264 main video stream in 8-bit 4:2:0, and MPEG-TS output, where the
+ * parameter sets travel in-band and may change at the splice points.
+ * Otherwise the whole range is re-encoded, still frame accurate.
+ */
+static void setup_clip(TransSession *session, const char *filename) {
+    const EncodeParam *param = session->param;
+    ClipContext *clip = &session->clip;
+    AVFormatContext *ifmt_ctx = session->ifmt_ctx;
+    KeyframeIndex *index = NULL;
+    const KeyframeEntry *entry;
+    const AVBitStreamFilter *filter;
+    AVStream *stream;
+    AVRational frame_rate;
+    int64_t origin = 0, start, end;
+    unsigned int i;
+    int videos = 0;
+
+    if (param->end_time <= param->start_time || session->live)
+        return;
+    clip->enabled = 1;
+    clip->video_index = -1;
+    if (kfindex_load(filename, &index) < 0) {
+        /* the same origin seek_input uses */
+        if (ifmt_ctx->start_time != AV_NOPTS_VALUE)
+            origin = ifmt_ctx->start_time;
+    }else {
+        stream = ifmt_ctx->streams[index->stream_index];
+        if (stream->start_time != AV_NOPTS_VALUE)
+            origin = av_rescale_q(stream->start_time, stream->time_base, AV_TIME_BASE_Q);
+    }
+    clip->start = origin + (int64_t)(param->start_time * AV_TIME_BASE);
+    clip->end = origin + (int64_t)(param->end_time * AV_TIME_BASE);
+    if (param->clip_reencode)
+        goto end;
+
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        if (session->stream_ctx[i].dec_ctx
+            && ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            videos++;
+    }
+    if (!index || videos != 1 || !session->stream_ctx[index->stream_index].dec_ctx
+        || strcmp(param->output->muxer, "mpegts") != 0)
+        goto end;
+    stream = ifmt_ctx->streams[index->stream_index];
+    if (stream->codecpar->codec_id != AV_CODEC_ID_H264
+        || session->stream_ctx[index->stream_index].dec_ctx->pix_fmt != AV_PIX_FMT_YUV420P)
+        goto end;
+
+    /* first keyframe at or after start, last one at or before end */
+    start = av_rescale_q(clip->start, AV_TIME_BASE_Q, index->time_base);
+    end = av_rescale_q(clip->end, AV_TIME_BASE_Q, index->time_base);
+    entry = kfindex_lookup(index, start);
+    if (entry->pts < start && entry + 1 < index->entries + index->count)
+        entry++;
+    if (entry->pts < start)
+        goto end;
+    clip->copy_start = entry->pts;
+    clip->copy_end = end >= index->duration ? INT64_MAX : kfindex_lookup(index, end)->pts;
+    if (clip->copy_end <= clip->copy_start)
+        goto end; /* no whole GOP inside the clip */
+
+    filter = av_bsf_get_by_name("h264_mp4toannexb");
+    if (!filter || av_bsf_alloc(filter, &clip->bsf) < 0)
+        goto end;
+    clip->bsf->time_base_in = stream->time_base;
+    if (avcodec_parameters_copy(clip->bsf->par_in, stream->codecpar) < 0
+        || av_bsf_init(clip->bsf) < 0) {
+        av_bsf_free(&clip->bsf);
+        goto end;
+    }
+    clip->smart = 1;
+    clip->video_index = index->stream_index;
+    clip->time_base = stream->time_base;
+    clip->phase = clip->copy_start > start ? CLIP_HEAD : CLIP_COPY;
+    /* the re-encoded head has no B-frames; keep its dts below the reordered copy */
+    frame_rate = av_guess_frame_rate(ifmt_ctx, stream, NULL);
+    if (frame_rate.num > 0)
+        clip->dts_shift = av_rescale_q(stream->codecpar->video_delay + 1, av_inv_q(frame_rate), stream->time_base);
+    INFO_LOG("smart clip %0.3f-%0.3fs: copying from %0.3fs to %0.3fs\n", param->start_time, param->end_time,
+        (clip->copy_start - av_rescale_q(origin, AV_TIME_BASE_Q, index->time_base)) * av_q2d(index->time_base),
+        clip->copy_end == INT64_MAX ? param->end_time
+        : (clip->copy_end - av_rescale_q(origin, AV_TIME_BASE_Q, index->time_base)) * av_q2d(index->time_base));
+
+end:
+    if (!clip->smart)
+        INFO_LOG("clip %0.3f-%0.3fs: re-encoding all of it\n", param->start_time, param->end_time);
+    kfindex_free(&index);
+}
+
+/**
+ * Clips: drop packets after the end, and remuxed ones before the start.
+ * Decoded streams see everything from the seek point, their frames are
+ * trimmed after decoding.
+ */
+static int clip_skip_packet(TransSession *session, const AVPacket *packet) {
+    ClipContext *clip = &session->clip;
+    StreamContext *sctx = &session->stream_ctx[packet->stream_index];
+    AVRational time_base = session->ifmt_ctx->streams[packet->stream_index]->time_base;
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+    if (!clip->enabled || ts == AV_NOPTS_VALUE)
+        return 0;
+    if (av_compare_ts(ts, time_base, clip->end, AV_TIME_BASE_Q) >= 0)
+        sctx->past_end = 1;
+    if (sctx->past_end)
+        return 1;
+    return sctx->remux && av_compare_ts(ts, time_base, clip->start, AV_TIME_BASE_Q) < 0;
+}
+
+/* every transcoded stream has passed the end; sparse remuxed ones are not waited for */
+static int clip_finished(const TransSession *session) {
+    unsigned int i;
+
+    for (i = 0; i < session->ifmt_ctx->nb_streams; i++) {
+        if (session->stream_ctx[i].out_index >= 0 && !session->stream_ctx[i].remux
+            && !session->stream_ctx[i].past_end)
+            return 0;
+    }
+    return 1;
+}
+
+/** Write out the head before the first copied packet, and ready a fresh encoder for the tail. */
+static int finish_clip_head(TransSession *session, AVFrame *frame, int stream_index) {
+    StreamContext *sctx = &session->stream_ctx[stream_index];
+    AVPacket drain = { .data = NULL, .size = 0 };
+    AVCodecContext *enc_ctx;
+    int ret;
+
+    /* the null filter holds no frames, the decoder's reorder buffer may */
+    drain.stream_index = stream_index;
+    decode_video(session, frame, &drain);
+    avcodec_flush_buffers(sctx->dec_ctx);
+    if ((ret = flush_encoder(session, stream_index)) < 0)
+        return ret;
+    /* a drained libx264 takes no more frames */
+    enc_ctx = codec_pool_open_like(&sctx->enc_key, sctx->enc_ctx);
+    if (!enc_ctx)
+        return AVERROR(ENOMEM);
+    avcodec_free_context(&sctx->enc_ctx);
+    sctx->enc_ctx = enc_ctx;
+    return 0;
+}
+
+static int clip_copy_packet(TransSession *session, AVPacket *packet) {
+    ClipContext *clip = &session->clip;
+    int out_index = session->stream_ctx[packet->stream_index].out_index;
+    int ret;
+    int64_t t;
+
+    /* MP4 sources carry length-prefixed NALs and out-of-band parameter sets */
+    if ((ret = av_bsf_send_packet(clip->bsf, packet)) < 0)
+        return ret;
+    while ((ret = av_bsf_receive_packet(clip->bsf, packet)) >= 0) {
+        av_packet_rescale_ts(packet, clip->bsf->time_base_out, session->ofmt_ctx->streams[out_index]->time_base);
+        packet->stream_index = out_index;
+        packet->pos = -1;
+        clip->copied_packets++;
+        t = TRACE_BEGIN();
+        ret = av_interleaved_write_frame(session->ofmt_ctx, packet);
+        TRACE_END("mux.write", clip->video_index, t);
+        if (ret < 0)
+            WARNING_LOG("copying a packet of the clip failed: %s\n", av_err2str(ret));
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/** Smart clips: route a packet of the main video stream by the phase the clip is in. */
+static int clip_video_packet(TransSession *session, AVFrame *frame, AVPacket *packet) {
+    ClipContext *clip = &session->clip;
+    StreamContext *sctx = &session->stream_ctx[packet->stream_index];
+    int key = packet->flags & AV_PKT_FLAG_KEY;
+    int ret;
+
+    if (clip->phase == CLIP_HEAD && key && packet->pts != AV_NOPTS_VALUE && packet->pts >= clip->copy_start) {
+        clip->copy_start = packet->pts;
+        if ((ret = finish_clip_head(session, frame, packet->stream_index)) < 0)
+            return ret;
+        clip->phase = CLIP_COPY;
+    }
+    if (clip->phase == CLIP_COPY && key && packet->pts != AV_NOPTS_VALUE && packet->pts >= clip->copy_end)
+        clip->phase = CLIP_TAIL;
+
+    if (clip->phase == CLIP_COPY) {
+        /* leading pictures of an open GOP belong to the head, which is already written */
+        if (packet->pts != AV_NOPTS_VALUE && packet->pts < clip->copy_start)
+            return 0;
+        return clip_copy_packet(session, packet);
+    }
+    av_packet_rescale_ts(packet, clip->time_base, sctx->dec_ctx->time_base);
+    return decode_video(session, frame, packet);
+}
+
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+/**
+ * Background transcodes only use CPU and disk time nobody else wants, until
+ * a viewer waits on one. Applies to every thread of pid, 0 = the calling
+ * process. Leaving SCHED_IDLE needs CAP_SYS_NICE or a RLIMIT_NICE of 20.
+ */
+int set_trans_task_priority(pid_t pid, int background)
+{
+    struct sched_param sp = { .sched_priority = 0 };
+    struct dirent *de;
+    char path[64];
+    DIR *dir;
+    pid_t tid;
+    int ret = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid > 0 ? (int)pid : (int)getpid());
+    if ((dir = opendir(path)) == NULL)
+        return AVERROR(errno);
+    while ((de = readdir(dir)) != NULL) {
+        if ((tid = atoi(de->d_name)) <= 0)
+            continue;
+        if (background) {
+            if (sched_setscheduler(tid, SCHED_IDLE, &sp) < 0)
+                setpriority(PRIO_PROCESS, tid, 19);
+        }else if (sched_setscheduler(tid, SCHED_OTHER, &sp) < 0 || setpriority(PRIO_PROCESS, tid, 0) < 0) {
+            ret = AVERROR(errno);
+        }
+#ifdef SYS_ioprio_set
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, background ? IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT : 0);
+#endif
+    }
+    closedir(dir);
+    return ret;
+}
+
+/**
+ * Fork a child running create_trans_task with its output on a pipe.
+ * Returns the read end of the pipe, or a negative AVERROR on failure.
+ */
+int spawn_trans_task(char *input_filename, const EncodeParam *param, pid_t *pid) {
+    int pfds[2];
+    int ret;
+
+    if (pipe(pfds) < 0)
+        return AVERROR(errno);
+
+    *pid = fork();
+    if (*pid < 0) {
+        ret = AVERROR(errno);
+        close(pfds[0]);
+        close(pfds[1]);
+        return ret;
+    }else if (*pid == 0) {
+        dup2(pfds[1], STDOUT_FILENO);
+        close(pfds[0]);
+        close(pfds[1]);
+        av_log_set_level(AV_LOG_ERROR);
+        if (param != NULL && param->background)
+            set_trans_task_priority(0, 1);
+        ret = create_trans_task(input_filename, "pipe:", param);
+        _exit(ret < 0 ? 1 : 0);
+    }
+
+    close(pfds[1]);
+    return pfds[0];
+}
+
+/** Pick the stream whose keyframes start segments: the first transcoded video, else audio. */
+static int setup_segments(TransSession *session) {
+    const SegmentOutput *segments = session->segments;
     enum AVMediaType type;
+    unsigned int i;
+
+    session->segment_stream = -1;
+    for (i = 0; i < session->ifmt_ctx->nb_streams; i++) {
+        type = session->ifmt_ctx->streams[i]->codecpar->codec_type;
+        if (!session->stream_ctx[i].enc_ctx)
+            continue;
+        if (type == AVMEDIA_TYPE_VIDEO) {
+            session->segment_stream = i;
+            break;
+        }else if (type == AVMEDIA_TYPE_AUDIO && session->segment_stream < 0) {
+            session->segment_stream = i;
+        }
+    }
+    if (session->segment_stream < 0) {
+        ERROR_LOG("no transcoded stream to cut segments at!\n");
+        return AVERROR(EINVAL);
+    }
+    /* a later first segment is a clip: it counts from the clip's origin */
+    if (session->clip.enabled)
+        session->segment_origin = session->clip.start - (int64_t)(session->param->start_time * AV_TIME_BASE);
+    else if (session->ifmt_ctx->start_time != AV_NOPTS_VALUE)
+        session->segment_origin = session->ifmt_ctx->start_time;
+    session->segment_index = segments->first;
+    session->next_keyframe = session->segment_origin + segments->first * (int64_t)(segments->duration * AV_TIME_BASE);
+    return 0;
+}
+
+static int run_trans_task(char *input_filename, char *output_filename, const EncodeParam *param,
+    const SegmentOutput *segments) {
+
+    int ret, i;
+    int stream_index;
+    int read_errors = 0;
+    int read_error = 0;
+    const char *name;
+    EncodeParam local_param;
+    TransSession session = { 0 };
+    StreamContext *stream_ctx;
     AVPacket packet = { .data = NULL,.size = 0 };
     AVFrame *frame = NULL;
-    int(*dec_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
+    AVFrame *held;
+    int64_t t;
+    int number = 0, events;
+    char trace_path[1024];
 
 
     if(input_filename == NULL || output_filename == NULL){
         return -1;
     }
 
+    if (!param) {
+        init_encode_param(&local_param);
+        param = &local_param;
+    }
+    session.start_time = av_gettime_relative();
+    name = strrchr(input_filename, '/');
+    number = __atomic_add_fetch(&session_counter, 1, __ATOMIC_RELAXED);
+    log_set_tag("s%d:%s", number, name ? name + 1 : input_filename);
+    if (param->trace && trace_enabled() && trace_start() < 0)
+        WARNING_LOG("no memory for the trace ring, not tracing\n");
+    session.stream_video_index = -1;
+    session.stream_audio_index = -1;
+    session.segments = segments;
+
     init_ffmpeg();
-    set_av_log_level();
 
-    if((ret = open_input_file(input_filename, &ifmt_ctx, &stream_ctx)) < 0){
+    session.live = is_live_input(input_filename);
+    if (param->rate_control == RC_AUTO && !session.live) {
+        session.tuned_param = *param;
+        apply_content_aware_rate(input_filename, &session.tuned_param);
+        param = &session.tuned_param;
+    }
+    session.param = param;
+
+    if((ret = open_input_file(&session, input_filename)) < 0){
         goto end;
     }
+    for (i = 0; i < session.ifmt_ctx->nb_streams; i++)
+        session.stream_ctx[i].next_dts = AV_NOPTS_VALUE;
+    setup_clip(&session, input_filename);
 
-    if((ret = open_output_file(output_filename, ifmt_ctx, &ofmt_ctx, &stream_ctx)) < 0){
+    if (!session.live && param->start_time > 0
+        && (ret = seek_input(input_filename, session.ifmt_ctx, param->start_time)) < 0) {
+        ERROR_LOG("seek to %0.3fs failed: %s!\n", param->start_time, av_err2str(ret));
         goto end;
     }
 
-    if ((ret = init_filters(ifmt_ctx, ofmt_ctx, stream_ctx, &filter_ctx)) < 0) {
+    if((ret = open_output_file(&session, output_filename)) < 0){
+        goto end;
+    }
+    if (segments && (ret = setup_segments(&session)) < 0)
+        goto end;
+
+    if ((ret = init_filters(&session)) < 0) {
         goto end;
     }
 
     /** Write the header of the output file container. */
-    if ((ret = write_output_file_header(ofmt_ctx)) < 0){
+    if ((ret = write_output_file_header(&session)) < 0){
+        goto end;
+    }
+
+    frame = av_frame_alloc();
+    if (!frame) {
+        ERROR_LOG("alloc frame error!\n");
+        ret = AVERROR(ENOMEM);
         goto end;
     }
 
     while (1){
-        if ((ret = av_read_frame(ifmt_ctx, &packet)) < 0) {
-            if (ret == AVERROR_EOF) {
+        if (session.stop) {
+            ret = AVERROR_EXIT;
+            goto end;
+        }
+        t = TRACE_BEGIN();
+        ret = av_read_frame(session.ifmt_ctx, &packet);
+        TRACE_END("read", ret < 0 ? -1 : packet.stream_index, t);
+        if (ret < 0) {
+            if (session.live && ret != AVERROR_EXIT) {
+                /* live sources drop and come back, EOF included */
+                ERROR_LOG("live input read error: %s!\n", av_err2str(ret));
+                if ((ret = reconnect_live_input(&session, input_filename)) < 0)
+                    break;
+                continue;
+            }else if (ret == AVERROR_EOF) {
                 INFO_LOG("read inputfile frame over!\n");
                 break;
             }else{
-                ERROR_LOG("read inputfile frame error: %s!", av_err2str(ret));
+                ERROR_LOG("read inputfile frame error: %s!\n", av_err2str(ret));
+                if (++read_errors >= MAX_READ_ERRORS) {
+                    ERROR_LOG("giving up after %d read errors\n", read_errors);
+                    read_error = ret;
+                    break;
+                }
+                if (ret == AVERROR(EAGAIN))
+                    av_usleep(10000);
                 continue;
             }
         }
+        read_errors = 0;
         stream_index = packet.stream_index;
-        type = ifmt_ctx->streams[stream_index]->codecpar->codec_type;
+        stream_ctx = &session.stream_ctx[stream_index];
         DEBUG_LOG("Demuxer gave frame of stream_index %u!\n", stream_index);
-        DEBUG_LOG("Going to reencode&filter the frame %u!\n", stream_index);
-
-        frame = av_frame_alloc();
-        if (!frame) {
-            ERROR_LOG("alloc frame error!\n");
-            ret = AVERROR(ENOMEM);
+        if (stream_ctx->out_index < 0) {
             av_packet_unref(&packet);
-            break;
+            continue;
+        }
+        if (clip_skip_packet(&session, &packet)) {
+            av_packet_unref(&packet);
+            if (clip_finished(&session))
+                break;
+            continue;
         }
+        if (session.clip.smart && stream_index == session.clip.video_index) {
+            clip_video_packet(&session, frame, &packet);
+            av_packet_unref(&packet);
+            continue;
+        }
+        if (stream_ctx->remux) {
+            if (session.live)
+                fix_live_timestamps(param, stream_ctx, &packet);
+            av_packet_rescale_ts(&packet, session.ifmt_ctx->streams[stream_index]->time_base,
+                session.ofmt_ctx->streams[stream_ctx->out_index]->time_base);
+            packet.stream_index = stream_ctx->out_index;
+            packet.pos = -1;
+            t = TRACE_BEGIN();
+            ret = av_interleaved_write_frame(session.ofmt_ctx, &packet);
+            TRACE_END("mux.write", stream_index, t);
+            if (ret < 0)
+                WARNING_LOG("remuxing a packet of stream #%d failed: %s\n", stream_index, av_err2str(ret));
+            av_packet_unref(&packet);
+            continue;
+        }
+        DEBUG_LOG("Going to reencode&filter the frame %u!\n", stream_index);
 
         av_packet_rescale_ts(&packet,
-            ifmt_ctx->streams[stream_index]->time_base,
-            stream_ctx[stream_index].dec_ctx->time_base);
+            session.ifmt_ctx->streams[stream_index]->time_base,
+            stream_ctx->dec_ctx->time_base);
+        if (session.live)
+            fix_live_timestamps(param, stream_ctx, &packet);
 
-        ret = decode(ifmt_ctx, ofmt_ctx, stream_ctx, filter_ctx, frame, &packet);
+        ret = decode(&session, frame, &packet);
+        av_packet_unref(&packet);
         if(ret < 0){
             continue;
         }
+    }
 
-        /*************************/
-        /*
-        AVCodecContext *dec_ctx, *enc_ctx;
-        stream_index = packet.stream_index;
-        dec_ctx = stream_ctx[stream_index].dec_ctx;
-        enc_ctx = stream_ctx[stream_index].enc_ctx;
+    /* flush decoders, filters and encoders */
+    for (i = 0; i < session.ifmt_ctx->nb_streams; i++) {
+        AVPacket drain = { .data = NULL, .size = 0 };
 
-        ret = avcodec_send_packet(dec_ctx, &packet);
-        if (ret < 0 && ret != AVERROR_EOF) {
-            ERROR_LOG("avcodec_send_packet fail %d\n", ret);
+        if (!session.filter_ctx[i].filter_graph)
             continue;
+        /* frames still in the decoder's reorder buffer */
+        drain.stream_index = i;
+        decode(&session, frame, &drain);
+        if ((held = decimate_flush(&session.stream_ctx[i].decimate)) != NULL) {
+            filter_encode_write_frame(&session, held, i);
+            av_frame_free(&held);
         }
-
-        while (ret >= 0) {
-            
-            ret = avcodec_receive_frame(dec_ctx, frame);
-
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                break;
-            }
-            else if (ret < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
-                goto end;
-            }
-
-            if (ret >= 0) {
-                
-                //frame->pts = frame->best_effort_timestamp;  
-                frame->pts = av_frame_get_best_effort_timestamp(frame);
-                ret = filter_encode_write_frame(ifmt_ctx, ofmt_ctx, stream_ctx, filter_ctx, frame, stream_index);
-                av_frame_free(&frame);
-                if (ret < 0) {
-                    goto end;
-                }
-            }
-            else {
-                av_frame_free(&frame);
-            }
-
-        }
-        */
-        /******************************/
-        
-    }
-
-    /* flush filters and encoders */
-    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
         /* flush filter */
-        if (!filter_ctx[i].filter_graph)
-            continue;
-        ret = filter_encode_write_frame(ifmt_ctx, ofmt_ctx, stream_ctx, filter_ctx, NULL, i);
+        ret = filter_encode_write_frame(&session, NULL, i);
         if (ret < 0) {
             ERROR_LOG("Flushing filter failed: %s!\n", av_err2str(ret));
             goto end;
         }
 
         /* flush encoder */
-        ret = flush_encoder(ifmt_ctx, ofmt_ctx, stream_ctx, i);
+        ret = flush_encoder(&session, i);
         if (ret < 0) {
             ERROR_LOG("Flushing encoder failed: %s!\n", av_err2str(ret));
             goto end;
         }
     }
 
-    av_write_trailer(ofmt_ctx);
+    /* the exit status of a spawned task tells the cache whether the output is complete */
+    if ((ret = av_write_trailer(session.ofmt_ctx)) < 0)
+        ERROR_LOG("Writing trailer failed: %s!\n", av_err2str(ret));
+    if (ret >= 0 && read_error < 0)
+        ret = read_error;
+    if (segments && ret >= 0 && !session.stop) {
+        avio_flush(session.ofmt_ctx->pb);
+        segments->segment_end(segments->opaque, session.segment_index);
+    }
+    if (session.clip.smart)
+        INFO_LOG("clip: %d frames re-encoded, %d packets copied\n",
+            session.clip.encoded_frames, session.clip.copied_packets);
+    for (i = 0; i < session.ifmt_ctx->nb_streams; i++) {
+        if (session.stream_ctx[i].decimate.enabled)
+            INFO_LOG("decimate: stream #%d, %d of %d frames dropped\n", i,
+                session.stream_ctx[i].decimate.dropped, session.stream_ctx[i].decimate.frames);
+    }
+    log_session_memory(&session);
 
 end:
     av_packet_unref(&packet);
     av_frame_free(&frame);
-    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        avcodec_free_context(&stream_ctx[i].dec_ctx);
-        if (ofmt_ctx && ofmt_ctx->nb_streams > i && ofmt_ctx->streams[i] && stream_ctx[i].enc_ctx)
-            avcodec_free_context(&stream_ctx[i].enc_ctx);
-        if (filter_ctx && filter_ctx[i].filter_graph)
-            avfilter_graph_free(&filter_ctx[i].filter_graph);
-    }
-    av_free(filter_ctx);
-    av_free(stream_ctx);
-    avformat_close_input(&ifmt_ctx);
-    if (ofmt_ctx && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&ofmt_ctx->pb);
-    avformat_free_context(ofmt_ctx);
+    for (i = 0; session.ifmt_ctx && session.stream_ctx && i < session.ifmt_ctx->nb_streams; i++) {
+        stream_ctx = &session.stream_ctx[i];
+        decimate_uninit(&stream_ctx->decimate);
+        codec_pool_put(&stream_ctx->dec_key, &stream_ctx->dec_ctx);
+        avcodec_free_context(&stream_ctx->dec_ctx);
+        if (stream_ctx->enc_ctx)
+            codec_pool_put(&stream_ctx->enc_key, &stream_ctx->enc_ctx);
+        if (session.filter_ctx && session.filter_ctx[i].filter_graph)
+            avfilter_graph_free(&session.filter_ctx[i].filter_graph);
+    }
+    av_bsf_free(&session.clip.bsf);
+    av_free(session.filter_ctx);
+    av_free(session.stream_ctx);
+    close_input_format(&session.ifmt_ctx);
+    if (session.ofmt_ctx && segments && session.ofmt_ctx->pb) {
+        av_freep(&session.ofmt_ctx->pb->buffer);
+        avio_context_free(&session.ofmt_ctx->pb);
+    }else if (session.ofmt_ctx && !segments && !(session.ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&session.ofmt_ctx->pb);
+    }
+    avformat_free_context(session.ofmt_ctx);
 
-    return 0;
-}
\ No newline at end of file
+    if (trace_active) {
+        snprintf(trace_path, sizeof(trace_path), "%s/trace-%d-%d.json", trace_get_dir(), (int)getpid(), number);
+        if ((events = trace_stop(trace_path, input_filename)) >= 0)
+            INFO_LOG("trace: %d events written to %s\n", events, trace_path);
+        else
+            WARNING_LOG("writing trace %s failed: %s\n", trace_path, av_err2str(events));
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+int create_trans_task(char *input_filename, char *output_filename, const EncodeParam *param) {
+    return run_trans_task(input_filename, output_filename, param, NULL);
+}
+
+/** Transcode to segments (see SegmentOutput) on the calling thread instead of to a file. */
+int create_segmented_task(char *input_filename, const EncodeParam *param, const SegmentOutput *segments) {
+    return run_trans_task(input_filename, "segments.ts", param, segments);
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -23,6 +24,10 @@
 #include <libavformat/avio.h>
 #include <libswresample/swresample.h>
 
+#include "codec_pool.h"
+#include "output_format.h"
+#include "decimate.h"
+
 
 
 
@@ -43,13 +48,58 @@ enum log_level_enum
 typedef struct StreamContext {
     AVCodecContext *dec_ctx;
     AVCodecContext *enc_ctx;
+    CodecPoolKey dec_key;
+    CodecPoolKey enc_key;
+    int out_index;          /* output stream, -1 = dropped */
+    int remux;              /* copied as-is, no decoder or encoder */
+    /* live inputs: timestamp continuity across reconnects, decoder time base */
+    int64_t next_dts;
+    int64_t ts_offset;
+    int resync;
+    int past_end;           /* clips: packets from here on are all after the end */
+    DecimateContext decimate;
 } StreamContext;
 
+enum encode_profile_enum
+{
+    PROFILE_DEFAULT = 0,
+    PROFILE_LOW_LATENCY,
+};
+
+enum rate_control_enum
+{
+    RC_ABR = 0,             /* average bitrate from vbitrate */
+    RC_AUTO,                /* CRF and VBV cap chosen from a complexity pass */
+};
+
 typedef struct EncodeParam
 {
     char *vcoder;
     char *acoder;
-    int *vbitrate;
+    int vbitrate;
+    enum encode_profile_enum profile;
+    int gop_size;           /* fixed GOP length in frames, 0 = encoder default */
+    int intra_refresh;      /* periodic intra refresh instead of IDR frames */
+    int vbv_maxrate;        /* bit/s, 0 = no VBV cap */
+    int vbv_bufsize;        /* bits, 0 = half a second of vbv_maxrate */
+    int mux_max_delay;      /* microseconds, 0 = muxer default */
+    int muxrate;            /* mpegts constant mux rate in bit/s, 0 = VBR */
+    int wallclock_timestamps; /* live inputs: stamp packets with arrival time */
+    const OutputFormat *output;
+    double start_time;      /* seconds, start at the GOP containing it */
+    enum rate_control_enum rate_control;
+    float crf;              /* constant rate factor, 0 = use vbitrate */
+    int max_width;          /* longer side of the output, 0 = source size */
+    int max_height;         /* shorter side of the output, 0 = source size */
+    int max_fps;            /* output frame rate cap, 0 = source rate */
+    int passthrough;        /* remux subtitle/data streams the muxer supports */
+    char video_tracks[32];  /* track selection, see select_stream(); "" = best track */
+    char audio_tracks[32];
+    double end_time;        /* seconds; makes start_time frame accurate and cuts a clip */
+    int clip_reencode;      /* clips: re-encode whole GOPs too (cluster chunks) */
+    int decimate;           /* drop repeated video frames before the filters */
+    int background;         /* spawn at idle CPU and I/O priority; not part of the output */
+    int trace;              /* write a Chrome trace of the session; not part of the output */
 } EncodeParam;
 
 typedef struct FilteringContext {
@@ -58,8 +108,96 @@ typedef struct FilteringContext {
     AVFilterGraph* filter_graph;
 }FilteringContext;
 
+enum clip_phase_enum
+{
+    CLIP_HEAD = 0,          /* re-encoding up to the first whole GOP */
+    CLIP_COPY,              /* copying whole GOPs */
+    CLIP_TAIL,              /* re-encoding the partial GOP at the end */
+};
+
+/**
+ * A ?start=&end= clip. With smart rendering only the partial GOPs at both
+ * edges go through the decoder and encoder; the whole GOPs between them are
+ * copied. Timestamps are on the source timeline.
+ */
+typedef struct ClipContext {
+    int enabled;
+    int64_t start;              /* AV_TIME_BASE_Q */
+    int64_t end;
+    int smart;
+    enum clip_phase_enum phase;
+    int video_index;            /* input stream the phases apply to */
+    AVRational time_base;       /* of that stream */
+    int64_t copy_start;         /* time_base: first keyframe inside the clip */
+    int64_t copy_end;           /* keyframe the tail starts at, INT64_MAX = copy to the end */
+    int64_t dts_shift;          /* lowers the head's dts below the copy's reordered ones */
+    AVBSFContext *bsf;
+    int encoded_frames;
+    int copied_packets;
+} ClipContext;
+
+/**
+ * What one session may hold, split from the -session-memory budget. Each
+ * part is also the estimate logged at the end, next to the peak RSS.
+ */
+typedef struct SessionMemory {
+    int64_t demux;              /* probe and index buffers */
+    int64_t frames;             /* decoded and filtered pictures */
+    int64_t encoder;            /* x264 lookahead, references and frame threads */
+    int64_t mux;                /* interleave queue */
+    int lookahead;              /* x264 rc-lookahead: the default, 0 with zerolatency, or what the budget allows */
+    int encoder_threads;
+    int64_t interleave_delta;   /* microseconds, 0 = muxer default */
+} SessionMemory;
+
+/**
+ * MPEG-TS output cut into segments of duration seconds on the source
+ * timeline, numbered from the start of the source. The session starts at
+ * segment first (EncodeParam start_time) and forces a keyframe at every
+ * segment start; each segment also starts with the PAT and PMT. write gets
+ * the bytes of the current segment, segment_end is called once all of them
+ * are written, and the session stops when it returns < 0.
+ */
+typedef struct SegmentOutput {
+    double duration;
+    int first;
+    void *opaque;
+    int (*write)(void *opaque, uint8_t *buf, int size);
+    int (*segment_end)(void *opaque, int index);
+} SegmentOutput;
+
+/** Everything one transcode touches, so sessions can run side by side in one process. */
+typedef struct TransSession {
+    const EncodeParam *param;
+    EncodeParam tuned_param;    /* param after content-aware rate selection */
+    AVFormatContext *ifmt_ctx;
+    AVFormatContext *ofmt_ctx;
+    StreamContext *stream_ctx;
+    FilteringContext *filter_ctx;
+    int stream_video_index;
+    int stream_audio_index;
+    int live;
+    int64_t start_time;         /* av_gettime_relative() when the session began */
+    int first_packet_written;
+    ClipContext clip;
+    SessionMemory memory;
+    const SegmentOutput *segments;
+    int segment_stream;         /* input stream whose keyframes start segments */
+    int segment_index;          /* segment being written */
+    int64_t segment_origin;     /* AV_TIME_BASE_Q, source time of segment 0 */
+    int64_t next_keyframe;      /* AV_TIME_BASE_Q, next segment start to force a keyframe at */
+    int stop;                   /* segment_end asked to stop */
+} TransSession;
+
 enum log_level_enum getLogLevel();
+void init_ffmpeg();
 void set_log_level(enum log_level_enum level);
-int create_trans_task(char *inputfilename, char *outputpath);
+void set_session_memory_limit(int64_t bytes);
+void init_encode_param(EncodeParam *param);
+void encode_param_signature(const EncodeParam *param, char *buf, int size);
+int create_trans_task(char *inputfilename, char *outputpath, const EncodeParam *param);
+int spawn_trans_task(char *inputfilename, const EncodeParam *param, pid_t *pid);
+int set_trans_task_priority(pid_t pid, int background);
+int create_segmented_task(char *inputfilename, const EncodeParam *param, const SegmentOutput *segments);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include "hls.h"
+#include "log.h"
+
+/*
+ * HLS with segments encoded ahead of the client. Each playlist request
+ * gets its own stream: one encoder run, on a thread of the server, that
+ * cuts a single continuous transcode into segments held in memory. The
+ * run stays HLS_SEGMENTS_AHEAD segments ahead of the newest segment the
+ * client fetched, then waits. A fetch outside that window is a seek: the
+ * run is stopped and started again at the segment asked for. A stream
+ * nobody fetched from for HLS_IDLE_TIMEOUT seconds is stopped and freed.
+ */
+typedef struct HlsSegment {
+    uint8_t *data;
+    size_t size;
+    size_t allocated;
+    int ready;
+} HlsSegment;
+
+typedef struct HlsStream {
+    unsigned int id;
+    char path[512];
+    EncodeParam param;
+    double duration;            /* seconds, as probed for the playlist */
+    int nb_segments;
+    HlsSegment *segments;
+    int requested;              /* newest segment the client fetched, -1 = none yet */
+    int start;                  /* first segment of the current run */
+    int encoding;               /* segment the run is writing */
+    int done;                   /* the run ended: end of the source, or an error */
+    int restart;                /* a seek: stop the run and start again at start */
+    int closing;                /* idle: stop the run and free the stream */
+    int error;                  /* a write into the run's segments failed, 0 = none */
+    int refs;                   /* the encoder thread, and requests being served */
+    int64_t last_access;
+    pthread_cond_t cond;
+    struct HlsStream *next;
+} HlsStream;
+
+static HlsStream *streams = NULL;
+static int nb_streams = 0;
+static unsigned int stream_counter = 0;
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the caller holds streams_lock, here and below */
+static void drop_segment(HlsSegment *segment)
+{
+    av_freep(&segment->data);
+    segment->size = segment->allocated = 0;
+    segment->ready = 0;
+}
+
+static void release_stream(HlsStream *stream)
+{
+    int i;
+
+    if (--stream->refs > 0)
+        return;
+    for (i = 0; i < stream->nb_segments; i++)
+        drop_segment(&stream->segments[i]);
+    av_free(stream->segments);
+    pthread_cond_destroy(&stream->cond);
+    free(stream);
+}
+
+/** Wait for a change on the stream, or a second; the encoder thread notices idle streams here. */
+static void wait_stream(HlsStream *stream)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&stream->cond, &streams_lock, &deadline);
+    if (stream->refs == 1 && av_gettime_relative() - stream->last_access > HLS_IDLE_TIMEOUT * 1000000LL)
+        stream->closing = 1;
+}
+
+/* SegmentOutput callbacks, on the encoder thread */
+static int write_segment(void *opaque, uint8_t *buf, int size)
+{
+    HlsStream *stream = opaque;
+    HlsSegment *segment;
+    uint8_t *data;
+    size_t allocated;
+    int ret = size;
+
+    pthread_mutex_lock(&streams_lock);
+    if (stream->restart || stream->closing) {
+        ret = AVERROR_EXIT;
+    }else if (stream->error < 0) {
+        ret = stream->error;
+    }else if (stream->encoding < stream->nb_segments) {
+        /* past the last segment of the playlist there are only a few stray packets; they are dropped */
+        segment = &stream->segments[stream->encoding];
+        if (segment->size + size > segment->allocated) {
+            allocated = FFMAX(segment->allocated * 2, segment->size + size);
+            if ((data = av_realloc(segment->data, allocated)) == NULL) {
+                /* the segment now misses a piece: it, and the rest of the run, must not be served */
+                ret = stream->error = AVERROR(ENOMEM);
+                goto end;
+            }
+            segment->data = data;
+            segment->allocated = allocated;
+        }
+        memcpy(segment->data + segment->size, buf, size);
+        segment->size += size;
+    }
+
+end:
+    pthread_mutex_unlock(&streams_lock);
+    return ret;
+}
+
+static int end_segment(void *opaque, int index)
+{
+    HlsStream *stream = opaque;
+    int ret;
+
+    pthread_mutex_lock(&streams_lock);
+    if (stream->error < 0) {
+        ret = stream->error;
+        pthread_mutex_unlock(&streams_lock);
+        return ret;
+    }
+    if (index < stream->nb_segments && !stream->restart)
+        stream->segments[index].ready = 1;
+    stream->encoding = index + 1;
+    pthread_cond_broadcast(&stream->cond);
+    /* speculate only so far past what the client fetched */
+    while (!stream->restart && !stream->closing && stream->encoding > stream->requested + HLS_SEGMENTS_AHEAD)
+        wait_stream(stream);
+    ret = stream->restart || stream->closing ? AVERROR_EXIT : 0;
+    pthread_mutex_unlock(&streams_lock);
+    return ret;
+}
+
+static void *encoder_thread(void *arg)
+{
+    HlsStream *stream = arg;
+    SegmentOutput output = { HLS_SEGMENT_DURATION, 0, stream, write_segment, end_segment };
+    HlsStream **link;
+    EncodeParam param;
+    int ret;
+
+    pthread_mutex_lock(&streams_lock);
+    while (!stream->closing) {
+        if (stream->done && !stream->restart) {
+            wait_stream(stream);
+            continue;
+        }
+        stream->restart = 0;
+        stream->done = 0;
+        stream->error = 0;
+        stream->encoding = output.first = stream->start;
+        param = stream->param;
+        /* a frame accurate start keeps the segments where the playlist has them */
+        param.start_time = stream->start * HLS_SEGMENT_DURATION;
+        param.end_time = stream->duration + HLS_SEGMENT_DURATION;
+        param.clip_reencode = 1;
+        pthread_mutex_unlock(&streams_lock);
+
+        ret = create_segmented_task(stream->path, &param, &output);
+
+        pthread_mutex_lock(&streams_lock);
+        if (ret < 0 && !stream->restart && !stream->closing)
+            WARNING_LOG("hls stream %u: segmenting from %d failed: %s\n", stream->id, output.first, av_err2str(ret));
+        stream->done = 1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+
+    for (link = &streams; *link != NULL; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            nb_streams--;
+            break;
+        }
+    }
+    INFO_LOG("hls stream %u closed\n", stream->id);
+    pthread_cond_broadcast(&stream->cond);
+    release_stream(stream);
+    pthread_mutex_unlock(&streams_lock);
+    return NULL;
+}
+
+static double probe_duration(const char *path)
+{
+    AVFormatContext *ctx = NULL;
+    double duration = -1;
+
+    if (avformat_open_input(&ctx, path, NULL, NULL) < 0)
+        return -1;
+    if (avformat_find_stream_info(ctx, NULL) >= 0 && ctx->duration != AV_NOPTS_VALUE && ctx->duration > 0)
+        duration = ctx->duration / (double)AV_TIME_BASE;
+    avformat_close_input(&ctx);
+    return duration;
+}
+
+/** GET /hls/<url>.m3u8: start a stream, its first segments right away, and list them all. */
+static void serve_playlist(int client, HttpRequest *request, const char *path, const EncodeParam *param)
+{
+    HlsStream *stream;
+    pthread_attr_t attr;
+    pthread_t thread;
+    char *playlist = NULL;
+    size_t size, len;
+    double duration;
+    unsigned int id;
+    int i, ret, nb_segments;
+
+    if ((duration = probe_duration(path)) <= 0) {
+        not_found(client);
+        return;
+    }
+    if ((stream = calloc(1, sizeof(*stream))) == NULL)
+        goto fail;
+    snprintf(stream->path, sizeof(stream->path), "%s", path);
+    stream->param = *param;
+    /* segments are MPEG-TS whatever format= says */
+    stream->param.output = output_format_default();
+    stream->duration = duration;
+    stream->nb_segments = (int)((duration + HLS_SEGMENT_DURATION - 0.001) / HLS_SEGMENT_DURATION);
+    stream->requested = -1;
+    stream->refs = 1;
+    stream->last_access = av_gettime_relative();
+    if ((stream->segments = av_mallocz_array(stream->nb_segments, sizeof(*stream->segments))) == NULL) {
+        free(stream);
+        goto fail;
+    }
+    pthread_cond_init(&stream->cond, NULL);
+
+    pthread_mutex_lock(&streams_lock);
+    if (nb_streams >= HLS_MAX_STREAMS) {
+        release_stream(stream);
+        pthread_mutex_unlock(&streams_lock);
+        send_response(client, "503 Service Unavailable", "text/plain", NULL, "too many hls streams\n");
+        return;
+    }
+    stream->id = ++stream_counter;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, encoder_thread, stream);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        release_stream(stream);
+        pthread_mutex_unlock(&streams_lock);
+        goto fail;
+    }
+    stream->next = streams;
+    streams = stream;
+    nb_streams++;
+    /* the stream is not touched after this: its thread frees it */
+    id = stream->id;
+    nb_segments = stream->nb_segments;
+    pthread_mutex_unlock(&streams_lock);
+    INFO_LOG("hls stream %u for %s: %d segments\n", id, path, nb_segments);
+
+    size = 256 + nb_segments * 64;
+    if ((playlist = malloc(size)) == NULL)
+        goto fail;
+    len = snprintf(playlist, size, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n"
+        "#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:VOD\n", HLS_SEGMENT_DURATION);
+    for (i = 0; i < nb_segments; i++) {
+        len += snprintf(playlist + len, size - len, "#EXTINF:%0.3f,\n%s%u/%d.ts\n",
+            FFMIN(HLS_SEGMENT_DURATION, duration - i * HLS_SEGMENT_DURATION), HLS_URL_PREFIX, id, i);
+    }
+    len += snprintf(playlist + len, size - len, "#EXT-X-ENDLIST\n");
+    write_stream_header(client, request, "application/vnd.apple.mpegurl");
+    if (send_body(client, request, playlist, len) == 0)
+        end_body(client, request);
+    free(playlist);
+    return;
+
+fail:
+    send_response(client, "500 Internal Server Error", "text/plain", NULL, "cannot start the hls stream\n");
+}
+
+/** GET /hls/<stream>/<index>.ts: from memory, after waiting for the encoder at most. */
+static void serve_segment(int client, HttpRequest *request, unsigned int id, int index)
+{
+    HlsStream *stream;
+    HlsSegment *segment;
+    uint8_t *data = NULL;
+    size_t size = 0;
+    int i;
+
+    pthread_mutex_lock(&streams_lock);
+    for (stream = streams; stream != NULL && stream->id != id; stream = stream->next)
+        ;
+    if (stream == NULL || stream->closing || index < 0 || index >= stream->nb_segments) {
+        pthread_mutex_unlock(&streams_lock);
+        not_found(client);
+        return;
+    }
+    stream->refs++;
+    stream->last_access = av_gettime_relative();
+    stream->requested = index;
+    segment = &stream->segments[index];
+
+    /* waiting beats restarting as long as the run gets there within its window */
+    if (!segment->ready && (stream->done || index < stream->encoding
+        || index > stream->encoding + HLS_SEGMENTS_AHEAD)) {
+        INFO_LOG("hls stream %u: seek to segment %d, encoder at %d\n", id, index, stream->encoding);
+        for (i = 0; i < stream->nb_segments; i++)
+            drop_segment(&stream->segments[i]);
+        stream->start = index;
+        stream->restart = 1;
+    }
+    /* the one before stays for a retry; older ones are done with */
+    for (i = 0; i < index - 1; i++) {
+        if (stream->segments[i].data != NULL)
+            drop_segment(&stream->segments[i]);
+    }
+    pthread_cond_broadcast(&stream->cond);
+    while (!segment->ready && !stream->closing && !(stream->done && !stream->restart))
+        pthread_cond_wait(&stream->cond, &streams_lock);
+    if (segment->ready && (data = av_malloc(FFMAX(segment->size, 1))) != NULL) {
+        /* a copy: sending must not hold up the encoder, nor the segment be freed under us */
+        memcpy(data, segment->data, segment->size);
+        size = segment->size;
+    }
+    release_stream(stream);
+    pthread_mutex_unlock(&streams_lock);
+
+    if (data == NULL) {
+        send_response(client, "503 Service Unavailable", "text/plain", NULL, "segment not available\n");
+        return;
+    }
+    write_stream_header(client, request, "video/mp2t");
+    if (send_body(client, request, data, size) == 0)
+        end_body(client, request);
+    av_free(data);
+}
+
+/** Playlists and segments under HLS_URL_PREFIX; param comes from the playlist request. */
+void hls_serve(int client, HttpRequest *request, const EncodeParam *param)
+{
+    const char *name = request->url + strlen(HLS_URL_PREFIX);
+    size_t len = strlen(name), suffix = strlen(HLS_PLAYLIST_SUFFIX);
+    char url[255], path[512];
+    unsigned int id;
+    int index, n = 0;
+
+    if (len > suffix && strcmp(name + len - suffix, HLS_PLAYLIST_SUFFIX) == 0) {
+        snprintf(url, sizeof(url), "/%.*s", (int)(len - suffix), name);
+        snprintf(path, sizeof(path), file_path, url);
+        serve_playlist(client, request, path, param);
+    }else if (sscanf(name, "%u/%d.ts%n", &id, &index, &n) == 2 && n > 0 && name[n] == '\0') {
+        serve_segment(client, request, id, index);
+    }else {
+        not_found(client);
+    }
+}
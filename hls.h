@@ -0,0 +1,17 @@
+#pragma once
+#ifndef _HLS_H_
+#define _HLS_H_
+
+#include "server.h"
+#include "ffmpeg.h"
+
+#define HLS_URL_PREFIX "/hls/"
+#define HLS_PLAYLIST_SUFFIX ".m3u8"
+#define HLS_SEGMENT_DURATION 4      /* seconds */
+#define HLS_SEGMENTS_AHEAD 3        /* encoded past the newest segment a client asked for */
+#define HLS_IDLE_TIMEOUT 30         /* seconds without a request before a stream is stopped */
+#define HLS_MAX_STREAMS 32
+
+void hls_serve(int client, HttpRequest *request, const EncodeParam *param);
+
+#endif
@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "jobs.h"
+#include "log.h"
+
+/*
+ * Pre-transcode jobs. The queue lives in memory and is rewritten to
+ * "<cache dir>/jobs.queue" on every state change, so queued jobs survive a
+ * restart; a job that was running then is queued again. Workers hand each
+ * job to the runner, which spawns the transcode at idle priority.
+ */
+static char queue_path[512];
+static Job *jobs = NULL;            /* newest first */
+static int next_id = 1;
+static int nb_finished = 0;
+static job_runner run_job = NULL;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *state_names[] = { "queued", "running", "done", "failed" };
+
+/* queue file fields are space separated: escape spaces, controls and '%' as %XX */
+static void escape_field(char *dst, size_t size, const char *src)
+{
+    size_t i = 0;
+
+    for (; *src != '\0' && i + 4 < size; src++) {
+        if ((unsigned char)*src <= 0x20 || *src == '%' || *src == 0x7f)
+            i += snprintf(dst + i, size - i, "%%%02x", (unsigned char)*src);
+        else
+            dst[i++] = *src;
+    }
+    dst[i] = '\0';
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static void unescape_field(char *dst, size_t size, const char *src)
+{
+    size_t i = 0;
+
+    for (; *src != '\0' && i + 1 < size; src++) {
+        if (*src == '%' && hex_value(src[1]) >= 0 && hex_value(src[2]) >= 0) {
+            dst[i++] = hex_value(src[1]) * 16 + hex_value(src[2]);
+            src += 2;
+        }else {
+            dst[i++] = *src;
+        }
+    }
+    dst[i] = '\0';
+}
+
+/* the caller holds jobs_lock */
+static void save_queue()
+{
+    char tmp[560], url[sizeof(jobs->url) * 3], query[sizeof(jobs->query) * 3];
+    Job *job;
+    FILE *fp;
+    int ok;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", queue_path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        ERROR_LOG("cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    for (job = jobs; job != NULL; job = job->next) {
+        escape_field(url, sizeof(url), job->url);
+        escape_field(query, sizeof(query), job->query);
+        fprintf(fp, "job2 %d %d %d %lld %lld %s %s\n", job->id, job->priority, job->state,
+            (long long)job->created, (long long)job->finished, url,
+            query[0] ? query : "-");
+    }
+    ok = fclose(fp) == 0;
+    if (!ok || rename(tmp, queue_path) < 0) {
+        ERROR_LOG("cannot write %s\n", queue_path);
+        unlink(tmp);
+    }
+}
+
+static void load_queue()
+{
+    char line[4096], url[sizeof(jobs->url) * 3], query[sizeof(jobs->query) * 3];
+    long long created, finished;
+    Job *job, **tail = &jobs;
+    FILE *fp;
+    int version, state;
+
+    if ((fp = fopen(queue_path, "r")) == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        job = calloc(1, sizeof(*job));
+        if (job == NULL)
+            break;
+        if (sscanf(line, "job%d %d %d %d %lld %lld %764s %1535s", &version, &job->id, &job->priority, &state,
+                &created, &finished, url, query) != 8
+            || version < 1 || version > 2 || state < JOB_QUEUED || state > JOB_FAILED) {
+            free(job);
+            continue;
+        }
+        if (strcmp(query, "-") == 0)
+            query[0] = '\0';
+        if (version == 1) {
+            /* written unescaped */
+            snprintf(job->url, sizeof(job->url), "%s", url);
+            snprintf(job->query, sizeof(job->query), "%s", query);
+        }else {
+            unescape_field(job->url, sizeof(job->url), url);
+            unescape_field(job->query, sizeof(job->query), query);
+        }
+        /* interrupted by the restart: run it again */
+        job->state = state == JOB_RUNNING ? JOB_QUEUED : state;
+        job->created = created;
+        job->finished = finished;
+        if (job->state == JOB_DONE || job->state == JOB_FAILED)
+            nb_finished++;
+        if (job->id >= next_id)
+            next_id = job->id + 1;
+        *tail = job;
+        tail = &job->next;
+    }
+    fclose(fp);
+}
+
+/* highest priority, oldest first; the caller holds jobs_lock */
+static Job *next_queued()
+{
+    Job *job, *best = NULL;
+
+    for (job = jobs; job != NULL; job = job->next) {
+        if (job->state == JOB_QUEUED && (best == NULL || job->priority > best->priority
+                || (job->priority == best->priority && job->id < best->id)))
+            best = job;
+    }
+    return best;
+}
+
+/* forget the oldest finished jobs beyond JOBS_MAX_FINISHED; the caller holds jobs_lock */
+static void prune_finished()
+{
+    Job **link, **oldest, *job;
+
+    while (nb_finished > JOBS_MAX_FINISHED) {
+        oldest = NULL;
+        for (link = &jobs; *link != NULL; link = &(*link)->next) {
+            if ((*link)->state == JOB_DONE || (*link)->state == JOB_FAILED)
+                oldest = link;
+        }
+        if (oldest == NULL)
+            break;
+        job = *oldest;
+        *oldest = job->next;
+        free(job);
+        nb_finished--;
+    }
+}
+
+static void *job_worker(void *arg)
+{
+    Job *job, copy;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&jobs_lock);
+        while ((job = next_queued()) == NULL)
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        job->state = JOB_RUNNING;
+        save_queue();
+        copy = *job;
+        pthread_mutex_unlock(&jobs_lock);
+
+        log_set_tag("job%d", copy.id);
+        INFO_LOG("job %d: %s?%s\n", copy.id, copy.url, copy.query);
+        ret = run_job(&copy);
+        INFO_LOG("job %d %s\n", copy.id, ret < 0 ? "failed" : "done");
+
+        /* running jobs are never pruned, so job is still valid */
+        pthread_mutex_lock(&jobs_lock);
+        job->state = ret < 0 ? JOB_FAILED : JOB_DONE;
+        job->finished = time(NULL);
+        nb_finished++;
+        prune_finished();
+        save_queue();
+        pthread_mutex_unlock(&jobs_lock);
+    }
+    return NULL;
+}
+
+/** Load the queue kept in dir and start workers that feed it to runner. */
+int jobs_init(const char *dir, int workers, job_runner runner)
+{
+    pthread_t thread;
+    int i;
+
+    snprintf(queue_path, sizeof(queue_path), "%s/%s", dir, JOBS_QUEUE_FILE);
+    run_job = runner;
+    pthread_mutex_lock(&jobs_lock);
+    load_queue();
+    pthread_mutex_unlock(&jobs_lock);
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&thread, NULL, job_worker, NULL) != 0)
+            return -1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+int jobs_enabled()
+{
+    return run_job != NULL;
+}
+
+/** Queue a rendition of url; returns the job id. */
+int jobs_submit(const char *url, const char *query, int priority)
+{
+    Job *job;
+    int id;
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        return -1;
+    snprintf(job->url, sizeof(job->url), "%s", url);
+    snprintf(job->query, sizeof(job->query), "%s", query);
+    job->priority = priority;
+    job->state = JOB_QUEUED;
+    job->created = time(NULL);
+
+    pthread_mutex_lock(&jobs_lock);
+    id = job->id = next_id++;
+    job->next = jobs;
+    jobs = job;
+    save_queue();
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+    return id;
+}
+
+int jobs_get(int id, Job *job)
+{
+    Job *p;
+
+    pthread_mutex_lock(&jobs_lock);
+    for (p = jobs; p != NULL && p->id != id; p = p->next)
+        ;
+    if (p != NULL)
+        *job = *p;
+    pthread_mutex_unlock(&jobs_lock);
+    return p != NULL ? 0 : -1;
+}
+
+static void json_string(char *dst, size_t size, const char *src)
+{
+    size_t i = 0;
+
+    for (; *src != '\0' && i + 7 < size; src++) {
+        if (*src == '"' || *src == '\\') {
+            dst[i++] = '\\';
+            dst[i++] = *src;
+        }else if ((unsigned char)*src < 0x20) {
+            i += snprintf(dst + i, size - i, "\\u%04x", (unsigned char)*src);
+        }else {
+            dst[i++] = *src;
+        }
+    }
+    dst[i] = '\0';
+}
+
+static int job_json(const Job *job, char *buf, size_t size)
+{
+    char url[sizeof(job->url) * 2], query[sizeof(job->query) * 2];
+
+    json_string(url, sizeof(url), job->url);
+    json_string(query, sizeof(query), job->query);
+    return snprintf(buf, size, "{\"id\":%d,\"state\":\"%s\",\"priority\":%d,\"input\":\"%s\","
+        "\"options\":\"%s\",\"created\":%lld,\"finished\":%lld}",
+        job->id, state_names[job->state], job->priority, url, query,
+        (long long)job->created, (long long)job->finished);
+}
+
+/* form bodies percent-encode the slashes of input */
+static void url_decode(char *s)
+{
+    char *out = s;
+
+    for (; *s != '\0'; s++) {
+        if (*s == '%' && hex_value(s[1]) >= 0 && hex_value(s[2]) >= 0) {
+            *out++ = hex_value(s[1]) * 16 + hex_value(s[2]);
+            s += 2;
+        }else {
+            *out++ = *s == '+' ? ' ' : *s;
+        }
+    }
+    *out = '\0';
+}
+
+/* spec without the job's own input= and priority=, leaving the rendition options */
+static void rendition_options(const char *spec, char *query, size_t size)
+{
+    const char *p = spec, *end;
+    size_t len = 0, n;
+
+    query[0] = '\0';
+    while (*p != '\0') {
+        end = p + strcspn(p, "&");
+        n = end - p;
+        if (n > 0 && strncmp(p, "input=", 6) != 0 && strncmp(p, "priority=", 9) != 0
+            && len + n + 2 <= size) {
+            if (len > 0)
+                query[len++] = '&';
+            memcpy(query + len, p, n);
+            len += n;
+            query[len] = '\0';
+        }
+        p = *end == '&' ? end + 1 : end;
+    }
+}
+
+static void submit_job(int client, const char *spec)
+{
+    char url[255], value[32], path[512], query[512], headers[64], json[2048];
+    struct stat st;
+    Job job;
+    int id, priority = 0;
+
+    if (get_query_param(spec, "input", url, sizeof(url)) <= 0) {
+        send_response(client, "400 Bad Request", "text/plain", NULL, "input=<path> is required\n");
+        return;
+    }
+    url_decode(url);
+    snprintf(path, sizeof(path), file_path, url);
+    if (url[0] != '/' || strstr(url, "..") != NULL || stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        not_found(client);
+        return;
+    }
+    if (get_query_param(spec, "priority", value, sizeof(value)) > 0)
+        priority = atoi(value);
+    rendition_options(spec, query, sizeof(query));
+
+    if ((id = jobs_submit(url, query, priority)) < 0 || jobs_get(id, &job) < 0) {
+        cannot_execute(client);
+        return;
+    }
+    INFO_LOG("job %d queued: %s?%s priority %d\n", id, url, query, priority);
+    job_json(&job, json, sizeof(json));
+    strcat(json, "\n");
+    snprintf(headers, sizeof(headers), "Location: %s/%d\r\n", JOBS_URL_PREFIX, id);
+    send_response(client, "201 Created", "application/json", headers, json);
+}
+
+static void list_jobs(int client)
+{
+    char *buf;
+    size_t size = 16, len;
+    Job *job;
+
+    pthread_mutex_lock(&jobs_lock);
+    for (job = jobs; job != NULL; job = job->next)
+        size += 2048;
+    buf = malloc(size);
+    if (buf != NULL) {
+        len = snprintf(buf, size, "[");
+        for (job = jobs; job != NULL; job = job->next) {
+            len += job_json(job, buf + len, size - len);
+            if (job->next != NULL)
+                buf[len++] = ',';
+        }
+        snprintf(buf + len, size - len, "]\n");
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    if (buf == NULL) {
+        cannot_execute(client);
+        return;
+    }
+    send_response(client, "200 OK", "application/json", NULL, buf);
+    free(buf);
+}
+
+/**
+ * POST /jobs with input=<path>[&priority=<n>][&<rendition options>] as a
+ * form body or query string; GET /jobs/<id>; GET /jobs lists all of them.
+ */
+void jobs_serve(int client, HttpRequest *request)
+{
+    const char *rest = request->url + strlen(JOBS_URL_PREFIX);
+    char json[2048];
+    Job job;
+
+    if (!jobs_enabled()) {
+        send_response(client, "503 Service Unavailable", "text/plain", NULL,
+            "jobs need -cache and -jobs\n");
+    }else if (strcasecmp(request->method, "POST") == 0) {
+        if (*rest != '\0' && strcmp(rest, "/") != 0)
+            not_found(client);
+        else
+            submit_job(client, request->body != NULL ? request->body : request->query_string);
+    }else if (*rest == '\0' || strcmp(rest, "/") == 0) {
+        list_jobs(client);
+    }else if (rest[0] == '/' && jobs_get(atoi(rest + 1), &job) == 0) {
+        job_json(&job, json, sizeof(json));
+        strcat(json, "\n");
+        send_response(client, "200 OK", "application/json", NULL, json);
+    }else {
+        not_found(client);
+    }
+}
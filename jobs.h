@@ -0,0 +1,41 @@
+#pragma once
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+#include <stdint.h>
+
+#include "server.h"
+
+#define JOBS_URL_PREFIX "/jobs"
+#define JOBS_QUEUE_FILE "jobs.queue"
+#define JOBS_MAX_FINISHED 1000     /* done/failed jobs kept for GET /jobs/<id> */
+
+enum job_state_enum
+{
+    JOB_QUEUED = 0,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+};
+
+typedef struct Job {
+    int id;
+    int priority;           /* higher runs first, FIFO within a priority */
+    enum job_state_enum state;
+    int64_t created;        /* unix seconds */
+    int64_t finished;
+    char url[255];          /* asset, as in a GET request */
+    char query[512];        /* rendition options, as in a GET request */
+    struct Job *next;
+} Job;
+
+/** Produce the rendition of a job; returns < 0 on failure. Runs on a worker thread. */
+typedef int (*job_runner)(const Job *job);
+
+int jobs_init(const char *dir, int workers, job_runner runner);
+int jobs_enabled();
+int jobs_submit(const char *url, const char *query, int priority);
+int jobs_get(int id, Job *job);
+void jobs_serve(int client, HttpRequest *request);
+
+#endif
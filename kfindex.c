@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+
+#include "kfindex.h"
+
+/*
+ * Keyframe index sidecar: "<asset>.kfi" next to the asset, written once by
+ * a background demux-only scan. It holds the pts and byte offset of every
+ * keyframe of the main video stream plus the GOP length, and is only
+ * trusted while the asset's size and mtime match the header.
+ */
+typedef struct KeyframeIndexHeader {
+    char magic[4];
+    uint32_t version;
+    int64_t file_size;
+    int64_t file_mtime;
+    int32_t stream_index;
+    int32_t tb_num;
+    int32_t tb_den;
+    uint32_t count;
+    int64_t duration;
+} KeyframeIndexHeader;
+
+typedef struct IndexJob {
+    char filename[512];
+    struct IndexJob *next;
+} IndexJob;
+
+/* a file that could not be indexed, not tried again until it changes */
+typedef struct IndexFailure {
+    char filename[512];
+    time_t mtime;
+    off_t size;
+} IndexFailure;
+
+static IndexJob *index_queue = NULL;
+static IndexFailure index_failures[KFINDEX_MAX_FAILURES];
+static unsigned int index_failure_count = 0;   /* recorded so far; the oldest are overwritten */
+static char index_running[512];
+static int indexer_started = 0;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t index_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+/* a fork, prefork workers included, must not copy index_lock held by another thread */
+static void index_lock_prepare() {
+    pthread_mutex_lock(&index_lock);
+}
+
+static void index_lock_release() {
+    pthread_mutex_unlock(&index_lock);
+}
+
+static void lock_index_once() {
+    pthread_atfork(index_lock_prepare, index_lock_release, index_lock_release);
+}
+
+static void lock_index() {
+    pthread_once(&index_once, lock_index_once);
+    pthread_mutex_lock(&index_lock);
+}
+
+static void sidecar_path(const char *filename, char *path, int size) {
+    snprintf(path, size, "%s%s", filename, KFINDEX_SUFFIX);
+}
+
+static int append_entry(KeyframeIndex *index, int *allocated, int64_t pts, int64_t pos) {
+    KeyframeEntry *entries;
+
+    if (index->count == *allocated) {
+        *allocated = *allocated ? *allocated * 2 : 256;
+        entries = av_realloc_array(index->entries, *allocated, sizeof(*entries));
+        if (!entries)
+            return AVERROR(ENOMEM);
+        index->entries = entries;
+    }
+    index->entries[index->count].pts = pts;
+    index->entries[index->count].pos = pos;
+    index->entries[index->count].gop_frames = 0;
+    index->entries[index->count].reserved = 0;
+    index->count++;
+    return 0;
+}
+
+/** Demux the whole file once, without decoding, and record every video keyframe. */
+int kfindex_build(const char *filename, KeyframeIndex **index) {
+    AVFormatContext *ifmt_ctx = NULL;
+    AVPacket packet = { .data = NULL, .size = 0 };
+    KeyframeIndex *idx;
+    int allocated = 0;
+    int64_t ts, end = 0;
+    unsigned int i;
+    int ret;
+
+    if ((ret = avformat_open_input(&ifmt_ctx, filename, NULL, NULL)) < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(ifmt_ctx, NULL)) < 0)
+        goto end;
+    if ((ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0)
+        goto end;
+
+    idx = av_mallocz(sizeof(*idx));
+    if (!idx) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    idx->stream_index = ret;
+    idx->time_base = ifmt_ctx->streams[ret]->time_base;
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        if (i != idx->stream_index)
+            ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    while ((ret = av_read_frame(ifmt_ctx, &packet)) >= 0) {
+        if (packet.stream_index == idx->stream_index) {
+            ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+            if ((packet.flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE) {
+                if ((ret = append_entry(idx, &allocated, ts, packet.pos)) < 0) {
+                    av_packet_unref(&packet);
+                    kfindex_free(&idx);
+                    goto end;
+                }
+            }
+            if (idx->count > 0)
+                idx->entries[idx->count - 1].gop_frames++;
+            if (ts != AV_NOPTS_VALUE)
+                end = FFMAX(end, ts + packet.duration);
+        }
+        av_packet_unref(&packet);
+    }
+    idx->duration = end;
+    *index = idx;
+    ret = ret == AVERROR_EOF ? 0 : ret;
+
+end:
+    avformat_close_input(&ifmt_ctx);
+    return ret;
+}
+
+int kfindex_save(const char *filename, const KeyframeIndex *index) {
+    KeyframeIndexHeader header;
+    struct stat st;
+    char path[512], tmp[520];
+    FILE *fp;
+    int ok;
+
+    if (stat(filename, &st) < 0)
+        return AVERROR(errno);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KFINDEX_MAGIC, 4);
+    header.version = KFINDEX_VERSION;
+    header.file_size = st.st_size;
+    header.file_mtime = st.st_mtime;
+    header.stream_index = index->stream_index;
+    header.tb_num = index->time_base.num;
+    header.tb_den = index->time_base.den;
+    header.count = index->count;
+    header.duration = index->duration;
+
+    sidecar_path(filename, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (!fp)
+        return AVERROR(errno);
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(index->entries, sizeof(*index->entries), index->count, fp) == index->count;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+int kfindex_load(const char *filename, KeyframeIndex **index) {
+    KeyframeIndexHeader header;
+    KeyframeIndex *idx;
+    struct stat st;
+    char path[512];
+    FILE *fp;
+    int ret = AVERROR_INVALIDDATA;
+
+    if (stat(filename, &st) < 0)
+        return AVERROR(errno);
+    sidecar_path(filename, path, sizeof(path));
+    fp = fopen(path, "rb");
+    if (!fp)
+        return AVERROR(errno);
+
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, KFINDEX_MAGIC, 4) || header.version != KFINDEX_VERSION
+        || header.file_size != st.st_size || header.file_mtime != st.st_mtime
+        || header.tb_num <= 0 || header.tb_den <= 0)
+        goto end;
+
+    idx = av_mallocz(sizeof(*idx));
+    if (!idx) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    idx->stream_index = header.stream_index;
+    idx->time_base = (AVRational) { header.tb_num, header.tb_den };
+    idx->duration = header.duration;
+    idx->count = header.count;
+    idx->entries = av_malloc_array(FFMAX(header.count, 1), sizeof(*idx->entries));
+    if (!idx->entries || fread(idx->entries, sizeof(*idx->entries), header.count, fp) != header.count) {
+        kfindex_free(&idx);
+        goto end;
+    }
+    *index = idx;
+    ret = 0;
+
+end:
+    fclose(fp);
+    return ret;
+}
+
+void kfindex_free(KeyframeIndex **index) {
+    if (!*index)
+        return;
+    av_freep(&(*index)->entries);
+    av_freep(index);
+}
+
+/** Last keyframe at or before ts (index time base), or the first one. */
+const KeyframeEntry *kfindex_lookup(const KeyframeIndex *index, int64_t ts) {
+    int lo = 0, hi = index->count - 1, mid;
+
+    if (index->count == 0)
+        return NULL;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (index->entries[mid].pts <= ts)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return &index->entries[lo];
+}
+
+/**
+ * Split the file into runs of whole GOPs of at least chunk_duration (index
+ * time base). chunk_starts receives the entry index each chunk begins at.
+ */
+int kfindex_plan_chunks(const KeyframeIndex *index, int64_t chunk_duration, int **chunk_starts, int *nb_chunks) {
+    int *starts;
+    int i, n = 0;
+
+    starts = av_malloc_array(FFMAX(index->count, 1), sizeof(*starts));
+    if (!starts)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < index->count; i++) {
+        if (n == 0 || index->entries[i].pts - index->entries[starts[n - 1]].pts >= chunk_duration)
+            starts[n++] = i;
+    }
+    *chunk_starts = starts;
+    *nb_chunks = n;
+    return 0;
+}
+
+/* the caller holds index_lock */
+static int index_failed(const char *filename, const struct stat *st) {
+    unsigned int i;
+
+    for (i = 0; i < FFMIN(index_failure_count, KFINDEX_MAX_FAILURES); i++) {
+        if (index_failures[i].mtime == st->st_mtime && index_failures[i].size == st->st_size
+            && !strcmp(index_failures[i].filename, filename))
+            return 1;
+    }
+    return 0;
+}
+
+static void *indexer_thread(void *arg) {
+    KeyframeIndex *index = NULL;
+    IndexFailure *failure;
+    IndexJob *job;
+    struct stat st;
+    int64_t t0;
+    int ret;
+
+    while (1) {
+        lock_index();
+        index_running[0] = '\0';
+        while (index_queue == NULL)
+            pthread_cond_wait(&index_cond, &index_lock);
+        job = index_queue;
+        index_queue = job->next;
+        av_strlcpy(index_running, job->filename, sizeof(index_running));
+        pthread_mutex_unlock(&index_lock);
+
+        t0 = av_gettime_relative();
+        memset(&st, 0, sizeof(st));
+        if (stat(job->filename, &st) < 0)
+            ret = AVERROR(errno);
+        else if ((ret = kfindex_build(job->filename, &index)) >= 0)
+            ret = kfindex_save(job->filename, index);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_WARNING, "keyframe index of '%s' failed: %s\n", job->filename, av_err2str(ret));
+            lock_index();
+            failure = &index_failures[index_failure_count++ % KFINDEX_MAX_FAILURES];
+            av_strlcpy(failure->filename, job->filename, sizeof(failure->filename));
+            failure->mtime = st.st_mtime;
+            failure->size = st.st_size;
+            pthread_mutex_unlock(&index_lock);
+        }else {
+            av_log(NULL, AV_LOG_INFO, "indexed '%s': %d keyframes in %0.3fs\n", job->filename,
+                index->count, (av_gettime_relative() - t0) / 1000000.0);
+        }
+        kfindex_free(&index);
+        av_free(job);
+    }
+    return NULL;
+}
+
+void kfindex_start_indexer() {
+    pthread_t thread;
+
+    lock_index();
+    if (!indexer_started && pthread_create(&thread, NULL, indexer_thread, NULL) == 0) {
+        pthread_detach(thread);
+        indexer_started = 1;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+/** Queue the file for indexing unless it has an up to date sidecar, or could not be indexed as it is. */
+void kfindex_ensure(const char *filename) {
+    struct stat st, sst;
+    char path[512];
+    IndexJob *job, **link;
+
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+    sidecar_path(filename, path, sizeof(path));
+    if (stat(path, &sst) == 0 && sst.st_mtime >= st.st_mtime)
+        return;
+
+    lock_index();
+    if (!indexer_started || !strcmp(index_running, filename) || index_failed(filename, &st)) {
+        pthread_mutex_unlock(&index_lock);
+        return;
+    }
+    for (link = &index_queue; *link != NULL; link = &(*link)->next) {
+        if (!strcmp((*link)->filename, filename)) {
+            pthread_mutex_unlock(&index_lock);
+            return;
+        }
+    }
+    job = av_mallocz(sizeof(*job));
+    if (job) {
+        av_strlcpy(job->filename, filename, sizeof(job->filename));
+        *link = job;
+        pthread_cond_signal(&index_cond);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
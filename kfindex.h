@@ -0,0 +1,37 @@
+#pragma once
+#ifndef _KFINDEX_H_
+#define _KFINDEX_H_
+
+#include <stdint.h>
+#include <libavformat/avformat.h>
+
+#define KFINDEX_MAGIC "KFIX"
+#define KFINDEX_VERSION 1
+#define KFINDEX_SUFFIX ".kfi"
+#define KFINDEX_MAX_FAILURES 256    /* files remembered as not indexable */
+
+typedef struct KeyframeEntry {
+    int64_t pts;            /* in KeyframeIndex.time_base */
+    int64_t pos;            /* byte offset of the packet, -1 if unknown */
+    int32_t gop_frames;     /* frames up to the next keyframe */
+    int32_t reserved;
+} KeyframeEntry;
+
+typedef struct KeyframeIndex {
+    int stream_index;
+    AVRational time_base;
+    int64_t duration;       /* in time_base, end of the last GOP */
+    int count;
+    KeyframeEntry *entries;
+} KeyframeIndex;
+
+int kfindex_build(const char *filename, KeyframeIndex **index);
+int kfindex_load(const char *filename, KeyframeIndex **index);
+int kfindex_save(const char *filename, const KeyframeIndex *index);
+void kfindex_free(KeyframeIndex **index);
+const KeyframeEntry *kfindex_lookup(const KeyframeIndex *index, int64_t ts);
+int kfindex_plan_chunks(const KeyframeIndex *index, int64_t chunk_duration, int **chunk_starts, int *nb_chunks);
+void kfindex_start_indexer();
+void kfindex_ensure(const char *filename);
+
+#endif
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "server.h"
+#include "live.h"
+#include "log.h"
+
+#define TS_PACKET_SIZE 188
+#define LIVE_SEND_TIMEOUT 2
+
+typedef struct LiveClient {
+    int fd;
+    int done;
+    struct LiveClient *next;
+} LiveClient;
+
+/* One running ingest transcode, shared by every viewer of the same rendition. */
+typedef struct LiveChannel {
+    char key[384];
+    pid_t pid;
+    int fd;
+    int closing;
+    LiveClient *clients;
+    struct LiveChannel *next;
+} LiveChannel;
+
+static LiveSource live_sources[LIVE_MAX_SOURCES];
+static int nb_live_sources = 0;
+static LiveChannel *channels = NULL;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t live_cond = PTHREAD_COND_INITIALIZER;
+
+/** Register a source given as "name=url", optionally followed by ",wallclock". */
+int live_add_source(const char *spec)
+{
+    LiveSource *source;
+    const char *eq = strchr(spec, '=');
+    char *opt;
+
+    if (eq == NULL || eq == spec || nb_live_sources >= LIVE_MAX_SOURCES)
+        return -1;
+    source = &live_sources[nb_live_sources];
+    memset(source, 0, sizeof(*source));
+    snprintf(source->name, sizeof(source->name), "%.*s", (int)(eq - spec), spec);
+    snprintf(source->url, sizeof(source->url), "%s", eq + 1);
+    if ((opt = strrchr(source->url, ',')) != NULL && strcmp(opt, ",wallclock") == 0) {
+        *opt = '\0';
+        source->wallclock = 1;
+    }
+    nb_live_sources++;
+    return 0;
+}
+
+const LiveSource *live_find_source(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nb_live_sources; i++) {
+        if (strcmp(live_sources[i].name, name) == 0)
+            return &live_sources[i];
+    }
+    return NULL;
+}
+
+static int send_all(int fd, const char *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = send(fd, buf, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void drop_client(LiveClient **link)
+{
+    LiveClient *client = *link;
+
+    *link = client->next;
+    client->done = 1;
+    pthread_cond_broadcast(&live_cond);
+}
+
+/**
+ * Reads the transcoder pipe and copies it to every subscriber. Output is
+ * forwarded in whole TS packets so a viewer joining between two writes
+ * starts on a packet boundary.
+ */
+static void *live_channel_thread(void *arg)
+{
+    LiveChannel *channel = arg;
+    LiveChannel **link;
+    LiveClient **client;
+    char buffer[TS_PACKET_SIZE * 64];
+    size_t fill = 0, aligned;
+    ssize_t n;
+
+    while ((n = read(channel->fd, buffer + fill, sizeof(buffer) - fill)) > 0) {
+        fill += n;
+        aligned = fill - fill % TS_PACKET_SIZE;
+        if (aligned == 0)
+            continue;
+
+        pthread_mutex_lock(&live_lock);
+        client = &channel->clients;
+        while (*client != NULL) {
+            if (send_all((*client)->fd, buffer, aligned) < 0)
+                drop_client(client);
+            else
+                client = &(*client)->next;
+        }
+        if (channel->clients == NULL && !channel->closing) {
+            /* last viewer left: stop the ingest, the pipe reaches EOF soon after */
+            channel->closing = 1;
+            kill(channel->pid, SIGTERM);
+        }
+        pthread_mutex_unlock(&live_lock);
+
+        memmove(buffer, buffer + aligned, fill - aligned);
+        fill -= aligned;
+    }
+
+    pthread_mutex_lock(&live_lock);
+    while (channel->clients != NULL)
+        drop_client(&channel->clients);
+    for (link = &channels; *link != NULL; link = &(*link)->next) {
+        if (*link == channel) {
+            *link = channel->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&live_lock);
+
+    close(channel->fd);
+    waitpid(channel->pid, NULL, 0);
+    INFO_LOG("live channel %s stopped\n", channel->key);
+    free(channel);
+    return NULL;
+}
+
+static LiveChannel *start_channel(const LiveSource *source, const char *key, const EncodeParam *param)
+{
+    LiveChannel *channel;
+    EncodeParam live_param = *param;
+    pthread_t thread;
+
+    channel = calloc(1, sizeof(*channel));
+    if (channel == NULL)
+        return NULL;
+    snprintf(channel->key, sizeof(channel->key), "%s", key);
+    live_param.wallclock_timestamps = source->wallclock;
+    channel->fd = spawn_trans_task((char *)source->url, &live_param, &channel->pid);
+    if (channel->fd < 0) {
+        free(channel);
+        return NULL;
+    }
+    if (pthread_create(&thread, NULL, live_channel_thread, channel) != 0) {
+        kill(channel->pid, SIGTERM);
+        waitpid(channel->pid, NULL, 0);
+        close(channel->fd);
+        free(channel);
+        return NULL;
+    }
+    pthread_detach(thread);
+    channel->next = channels;
+    channels = channel;
+    INFO_LOG("live channel %s started from %s\n", channel->key, source->url);
+    return channel;
+}
+
+/**
+ * Attach a client to the channel for (source, query_string), starting the
+ * ingest if nobody is watching it yet. Blocks until the client goes away or
+ * the source ends.
+ */
+int live_serve(int client, const LiveSource *source, const char *query_string, const EncodeParam *param)
+{
+    LiveChannel *channel;
+    LiveClient self = { client, 0, NULL };
+    struct timeval timeout = { LIVE_SEND_TIMEOUT, 0 };
+    char key[384];
+
+    snprintf(key, sizeof(key), "%s?%s", source->name, query_string ? query_string : "");
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    write_ts_header(client);
+
+    pthread_mutex_lock(&live_lock);
+    for (channel = channels; channel != NULL; channel = channel->next) {
+        if (!channel->closing && strcmp(channel->key, key) == 0)
+            break;
+    }
+    if (channel == NULL && (channel = start_channel(source, key, param)) == NULL) {
+        pthread_mutex_unlock(&live_lock);
+        return -1;
+    }
+    self.next = channel->clients;
+    channel->clients = &self;
+    while (!self.done)
+        pthread_cond_wait(&live_cond, &live_lock);
+    pthread_mutex_unlock(&live_lock);
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#ifndef _LIVE_H_
+#define _LIVE_H_
+
+#include "ffmpeg.h"
+
+#define LIVE_MAX_SOURCES 32
+#define LIVE_URL_PREFIX "/live/"
+
+typedef struct LiveSource {
+    char name[64];
+    char url[512];
+    int wallclock;
+} LiveSource;
+
+int live_add_source(const char *spec);
+const LiveSource *live_find_source(const char *name);
+int live_serve(int client, const LiveSource *source, const char *query_string, const EncodeParam *param);
+
+#endif
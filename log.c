@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <libavutil/log.h>
+
+#include "log.h"
+
+#define LOG_SITES 16
+#define LOG_SITE_PROBES 4           /* slots a call site may hash to */
+#define LOG_DRAIN_INTERVAL 20000    /* microseconds */
+
+/*
+ * Every thread that logs gets its own ring. The owning thread is the only
+ * producer and the writer thread the only consumer, so pushing a record is
+ * a copy and a release store; no lock is taken on the transcoding path.
+ */
+typedef struct LogRecord {
+    int64_t time;
+    int level;
+    const char *file;
+    int line;
+    char tag[LOG_TAG_SIZE];
+    char text[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+typedef struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    unsigned int head;          /* next slot the owner writes */
+    unsigned int tail;          /* next slot the writer reads */
+    unsigned int dropped;       /* records lost to a full ring */
+    int closed;                 /* owner exited, free once drained */
+    struct LogRing *next;
+} LogRing;
+
+/* repeat counting per call site, per thread */
+typedef struct LogSite {
+    const void *key;
+    int line;
+    int level;
+    const char *file;
+    int64_t window;
+    int count;
+    int suppressed;
+} LogSite;
+
+int log_runtime_level = LOG_LEVEL_INFO;
+
+static __thread LogRing *thread_ring;
+static __thread LogSite thread_sites[LOG_SITES];
+static __thread char thread_tag[LOG_TAG_SIZE];
+static __thread int av_print_prefix = 1;
+static LogRing *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static int writer_running = 0;
+
+static int64_t now_us()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static const char *level_name(int level)
+{
+    if (level <= LOG_LEVEL_FATAL)
+        return "FATAL";
+    if (level <= LOG_LEVEL_ERROR)
+        return "ERROR";
+    if (level <= LOG_LEVEL_WARNING)
+        return "WARNING";
+    if (level <= LOG_LEVEL_INFO)
+        return "INFO";
+    if (level <= LOG_LEVEL_DEBUG - 8)
+        return "VERBOSE";
+    return level <= LOG_LEVEL_DEBUG ? "DEBUG" : "TRACE";
+}
+
+static void print_record(const LogRecord *record)
+{
+    char stamp[16];
+    struct tm tm;
+    time_t sec = record->time / 1000000;
+    size_t len = strlen(record->text);
+
+    localtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+    fprintf(stderr, "%s.%03d [%s] %s ", stamp, (int)(record->time / 1000 % 1000),
+        record->tag[0] ? record->tag : "-", level_name(record->level));
+    if (record->file)
+        fprintf(stderr, "%s:%d: ", record->file, record->line);
+    fputs(record->text, stderr);
+    if (len == 0 || record->text[len - 1] != '\n')
+        fputc('\n', stderr);
+}
+
+static void ring_destroy(void *arg)
+{
+    LogRing *ring = arg;
+
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static LogRing *get_ring()
+{
+    LogRing *ring = thread_ring;
+
+    if (ring)
+        return ring;
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+    pthread_setspecific(ring_key, ring);
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = ring;
+    return ring;
+}
+
+static void emit(int level, const char *file, int line, int64_t time, const char *text)
+{
+    LogRecord *record, sync_record;
+    LogRing *ring = NULL;
+    unsigned int head;
+
+    /* before log_init, and in forked children that have no writer thread */
+    if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+        ring = get_ring();
+    if (ring) {
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    }else {
+        record = &sync_record;
+    }
+    record->time = time;
+    record->level = level;
+    record->file = file;
+    record->line = line;
+    memcpy(record->tag, thread_tag, sizeof(record->tag));
+    snprintf(record->text, sizeof(record->text), "%s", text);
+    if (ring)
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    else
+        print_record(record);
+}
+
+static void flush_suppressed(LogSite *site, int64_t time)
+{
+    char text[64];
+
+    if (site->suppressed > 0) {
+        snprintf(text, sizeof(text), "%d similar messages suppressed", site->suppressed);
+        emit(site->level, site->file, site->line, time, text);
+    }
+    site->suppressed = 0;
+}
+
+/**
+ * Allow LOG_BURST messages per call site and second; the rest of the second
+ * is counted and reported once the site logs again. A site probes
+ * LOG_SITE_PROBES slots; when all are taken by other sites, the one idle
+ * longest is reported and handed over.
+ */
+static int rate_limit(const void *key, int line, int level, const char *file, int64_t time)
+{
+    unsigned int hash = ((uintptr_t)key ^ (unsigned)line * 31) % LOG_SITES;
+    LogSite *site = NULL, *slot;
+    int64_t window = time / 1000000;
+    int i;
+
+    for (i = 0; i < LOG_SITE_PROBES; i++) {
+        slot = &thread_sites[(hash + i) % LOG_SITES];
+        if (slot->key == key && slot->line == line) {
+            site = slot;
+            break;
+        }
+        if (site == NULL || slot->key == NULL || (site->key != NULL && slot->window < site->window))
+            site = slot;
+    }
+
+    if (site->key != key || site->line != line) {
+        flush_suppressed(site, time);
+        site->key = key;
+        site->line = line;
+        site->level = level;
+        site->file = file;
+        site->window = window;
+        site->count = 0;
+    }else if (site->window != window) {
+        flush_suppressed(site, time);
+        site->window = window;
+        site->count = 0;
+    }
+    if (++site->count > LOG_BURST) {
+        site->suppressed++;
+        return 1;
+    }
+    return 0;
+}
+
+void log_write(int level, const char *file, int line, const char *fmt, ...)
+{
+    char text[LOG_MESSAGE_SIZE];
+    int64_t time = now_us();
+    va_list vl;
+
+    if (rate_limit(file, line, level, file, time))
+        return;
+    va_start(vl, fmt);
+    vsnprintf(text, sizeof(text), fmt, vl);
+    va_end(vl);
+    emit(level, file, line, time, text);
+}
+
+/* FFmpeg's own messages, and every av_log() call, take the same path */
+static void log_av_callback(void *avcl, int level, const char *fmt, va_list vl)
+{
+    char text[LOG_MESSAGE_SIZE];
+    int64_t time;
+
+    if (level > av_log_get_level())
+        return;
+    time = now_us();
+    if (rate_limit(fmt, 0, level, NULL, time))
+        return;
+    av_log_format_line(avcl, level, fmt, vl, text, sizeof(text), &av_print_prefix);
+    emit(level, NULL, 0, time, text);
+}
+
+/** Tag the messages of the calling thread, e.g. with the session it runs. */
+void log_set_tag(const char *fmt, ...)
+{
+    va_list vl;
+
+    va_start(vl, fmt);
+    vsnprintf(thread_tag, sizeof(thread_tag), fmt, vl);
+    va_end(vl);
+}
+
+void log_set_level(int level)
+{
+    log_runtime_level = level;
+}
+
+/* the caller holds rings_lock, which makes it the only consumer */
+static void drain_rings()
+{
+    LogRing *ring, **link = &rings;
+    unsigned int head, tail, dropped;
+    int closed;
+
+    while ((ring = *link) != NULL) {
+        closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++)
+            print_record(&ring->records[tail & (LOG_RING_SIZE - 1)]);
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0)
+            fprintf(stderr, "log: %u messages dropped, ring full\n", dropped);
+        if (closed) {
+            *link = ring->next;
+            free(ring);
+        }else {
+            link = &ring->next;
+        }
+    }
+    fflush(stderr);
+}
+
+static void *log_writer_thread(void *arg)
+{
+    while (1) {
+        pthread_mutex_lock(&rings_lock);
+        drain_rings();
+        pthread_mutex_unlock(&rings_lock);
+        usleep(LOG_DRAIN_INTERVAL);
+    }
+    return NULL;
+}
+
+void log_flush()
+{
+    if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&rings_lock);
+    drain_rings();
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void log_after_fork_child()
+{
+    /* the writer thread did not survive the fork */
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    thread_ring = NULL;
+}
+
+static void log_init_once()
+{
+    pthread_t thread;
+
+    if (pthread_key_create(&ring_key, ring_destroy) != 0)
+        return;
+    av_log_set_callback(log_av_callback);
+    pthread_atfork(NULL, NULL, log_after_fork_child);
+    if (pthread_create(&thread, NULL, log_writer_thread, NULL) != 0)
+        return;
+    pthread_detach(thread);
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    atexit(log_flush);
+}
+
+/** Start the background writer; until then, and in forked children, logging is synchronous. */
+void log_init()
+{
+    pthread_once(&log_once, log_init_once);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdint.h>
+
+/* same values as AV_LOG_*, so av_log levels map one to one */
+#define LOG_LEVEL_FATAL   8
+#define LOG_LEVEL_ERROR   16
+#define LOG_LEVEL_WARNING 24
+#define LOG_LEVEL_INFO    32
+#define LOG_LEVEL_DEBUG   48
+
+/* calls above this level are compiled out; make LOG_LEVEL=48 for debug builds */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 256           /* records per thread, power of two */
+#define LOG_MESSAGE_SIZE 256
+#define LOG_TAG_SIZE 32
+#define LOG_BURST 10                /* messages per call site and second before suppressing */
+
+extern int log_runtime_level;
+
+#define LOG_AT(level, fmt, ...) do { \
+    if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_runtime_level) \
+        log_write(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__); \
+} while (0)
+
+#define DEBUG_LOG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define INFO_LOG(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define WARNING_LOG(fmt, ...) LOG_AT(LOG_LEVEL_WARNING, fmt, ##__VA_ARGS__)
+#define ERROR_LOG(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define FATAL_LOG(fmt, ...) LOG_AT(LOG_LEVEL_FATAL, fmt, ##__VA_ARGS__)
+
+void log_init();
+void log_set_level(int level);
+void log_set_tag(const char *fmt, ...);
+void log_write(int level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+void log_flush();
+
+#endif
@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "mmap_io.h"
+
+/* A read-only mapping of one file, shared by every session reading it. */
+typedef struct MappedFile {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    uint8_t *data;
+    int refcount;
+    struct MappedFile *next;
+} MappedFile;
+
+typedef struct FileReader {
+    MappedFile *map;        /* NULL when mmap failed and read() is used */
+    int fd;
+    int64_t size;
+    int64_t pos;
+    int64_t advised;        /* read-ahead has been requested up to here */
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    int ring_ready;
+    uint8_t *ahead;         /* block prefetched by io_uring */
+    int64_t ahead_pos;
+    int ahead_len;
+    int ahead_pending;
+#endif
+} FileReader;
+
+static MappedFile *mapped_files = NULL;
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t bus_once = PTHREAD_ONCE_INIT;
+static __thread sigjmp_buf *volatile bus_jump;
+static pthread_once_t mapped_once = PTHREAD_ONCE_INIT;
+
+/* a fork, prefork workers included, must not copy mapped_lock held by another thread */
+static void mapped_lock_prepare() {
+    pthread_mutex_lock(&mapped_lock);
+}
+
+static void mapped_lock_release() {
+    pthread_mutex_unlock(&mapped_lock);
+}
+
+static void lock_mapped_once() {
+    pthread_atfork(mapped_lock_prepare, mapped_lock_release, mapped_lock_release);
+}
+
+static void lock_mapped() {
+    pthread_once(&mapped_once, lock_mapped_once);
+    pthread_mutex_lock(&mapped_lock);
+}
+
+/*
+ * A mapped file that is truncated under us raises SIGBUS on the next read
+ * of the missing pages. Sessions also run on threads of the server, so the
+ * copy out of a mapping is guarded: the fault turns into a read error of
+ * that session instead of killing the process.
+ */
+static void on_bus_error(int sig) {
+    if (bus_jump != NULL)
+        siglongjmp(*bus_jump, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_bus_handler() {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_bus_error;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/** memcpy out of a mapping; < 0 if the file shrank below the mapped size. */
+static int map_copy(uint8_t *dst, const uint8_t *src, int len) {
+    sigjmp_buf jump;
+
+    if (sigsetjmp(jump, 1)) {
+        bus_jump = NULL;
+        return AVERROR(EIO);
+    }
+    bus_jump = &jump;
+    memcpy(dst, src, len);
+    bus_jump = NULL;
+    return len;
+}
+
+static MappedFile *map_acquire(int fd, const struct stat *st) {
+    MappedFile *map;
+    void *data;
+
+    if (st->st_size <= 0)
+        return NULL;
+
+    lock_mapped();
+    for (map = mapped_files; map != NULL; map = map->next) {
+        if (map->dev == st->st_dev && map->ino == st->st_ino
+            && map->mtime == st->st_mtime && map->size == st->st_size) {
+            map->refcount++;
+            pthread_mutex_unlock(&mapped_lock);
+            return map;
+        }
+    }
+
+    data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        pthread_mutex_unlock(&mapped_lock);
+        return NULL;
+    }
+    madvise(data, st->st_size, MADV_SEQUENTIAL);
+
+    map = av_mallocz(sizeof(*map));
+    if (!map) {
+        munmap(data, st->st_size);
+        pthread_mutex_unlock(&mapped_lock);
+        return NULL;
+    }
+    map->dev = st->st_dev;
+    map->ino = st->st_ino;
+    map->mtime = st->st_mtime;
+    map->size = st->st_size;
+    map->data = data;
+    map->refcount = 1;
+    map->next = mapped_files;
+    mapped_files = map;
+    pthread_mutex_unlock(&mapped_lock);
+
+    return map;
+}
+
+static void map_release(MappedFile *map) {
+    MappedFile **link;
+
+    lock_mapped();
+    if (--map->refcount == 0) {
+        for (link = &mapped_files; *link != NULL; link = &(*link)->next) {
+            if (*link == map) {
+                *link = map->next;
+                break;
+            }
+        }
+        munmap(map->data, map->size);
+        av_free(map);
+    }
+    pthread_mutex_unlock(&mapped_lock);
+}
+
+/** Ask the kernel for the next window once the reader gets close to the advised end. */
+static void read_ahead(FileReader *r) {
+    int64_t start, len;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (r->pos + MMAP_IO_READAHEAD / 2 < r->advised)
+        return;
+    start = r->pos & ~(int64_t)(page - 1);
+    len = FFMIN(MMAP_IO_READAHEAD, r->size - start);
+    if (len <= 0)
+        return;
+    if (r->map)
+        madvise(r->map->data + start, len, MADV_WILLNEED);
+    else
+        posix_fadvise(r->fd, start, len, POSIX_FADV_WILLNEED);
+    r->advised = start + len;
+}
+
+#ifdef HAVE_LIBURING
+static void uring_prefetch(FileReader *r) {
+    struct io_uring_sqe *sqe;
+
+    if (r->ahead_pending || r->pos >= r->size)
+        return;
+    sqe = io_uring_get_sqe(&r->ring);
+    if (!sqe)
+        return;
+    io_uring_prep_read(sqe, r->fd, r->ahead, MMAP_IO_BUFFER_SIZE, r->pos);
+    if (io_uring_submit(&r->ring) == 1) {
+        r->ahead_pos = r->pos;
+        r->ahead_len = 0;
+        r->ahead_pending = 1;
+    }
+}
+
+static void uring_complete(FileReader *r) {
+    struct io_uring_cqe *cqe;
+
+    if (!r->ahead_pending)
+        return;
+    if (io_uring_wait_cqe(&r->ring, &cqe) == 0) {
+        r->ahead_len = FFMAX(cqe->res, 0);
+        io_uring_cqe_seen(&r->ring, cqe);
+    }else {
+        r->ahead_len = 0;
+    }
+    r->ahead_pending = 0;
+}
+
+/** Serve from the prefetched block when possible, then queue the next one. */
+static int uring_read(FileReader *r, uint8_t *buf, int size) {
+    int64_t offset;
+    int len;
+
+    uring_complete(r);
+    offset = r->pos - r->ahead_pos;
+    if (r->ahead_len > 0 && offset >= 0 && offset < r->ahead_len) {
+        len = FFMIN(size, r->ahead_len - offset);
+        memcpy(buf, r->ahead + offset, len);
+    }else {
+        len = pread(r->fd, buf, size, r->pos);
+        if (len < 0)
+            return AVERROR(errno);
+    }
+    r->pos += len;
+    if (r->pos >= r->ahead_pos + r->ahead_len)
+        uring_prefetch(r);
+    return len;
+}
+#endif
+
+static int read_packet(void *opaque, uint8_t *buf, int buf_size) {
+    FileReader *r = opaque;
+    int len;
+
+    if (r->pos >= r->size)
+        return AVERROR_EOF;
+
+    read_ahead(r);
+    if (r->map) {
+        len = FFMIN(buf_size, r->size - r->pos);
+        if ((len = map_copy(buf, r->map->data + r->pos, len)) < 0)
+            return len;
+        r->pos += len;
+        return len;
+    }
+
+#ifdef HAVE_LIBURING
+    if (r->ring_ready)
+        len = uring_read(r, buf, buf_size);
+    else
+#endif
+    {
+        len = pread(r->fd, buf, buf_size, r->pos);
+        if (len < 0)
+            return AVERROR(errno);
+        r->pos += len;
+    }
+    return len == 0 ? AVERROR_EOF : len;
+}
+
+static int64_t seek(void *opaque, int64_t offset, int whence) {
+    FileReader *r = opaque;
+    int64_t pos;
+
+    if (whence == AVSEEK_SIZE)
+        return r->size;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = r->pos + offset;
+        break;
+    case SEEK_END:
+        pos = r->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    r->pos = pos;
+    r->advised = pos;
+    return pos;
+}
+
+static void reader_free(FileReader *r) {
+    if (r->map)
+        map_release(r->map);
+#ifdef HAVE_LIBURING
+    if (r->ring_ready) {
+        uring_complete(r);
+        io_uring_queue_exit(&r->ring);
+    }
+    av_free(r->ahead);
+#endif
+    if (r->fd >= 0)
+        close(r->fd);
+    av_free(r);
+}
+
+/**
+ * Open a regular file for demuxing through a shared read-only mapping.
+ * Files that cannot be mapped are read with pread (or io_uring when built
+ * with HAVE_LIBURING) plus kernel read-ahead hints.
+ */
+int mmap_io_open(const char *filename, AVIOContext **pb) {
+    FileReader *r;
+    struct stat st;
+    uint8_t *buffer;
+    int fd;
+
+    if (!strncmp(filename, "file:", 5))
+        filename += 5;
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return AVERROR(EINVAL);
+    }
+
+    r = av_mallocz(sizeof(*r));
+    buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+    if (!r || !buffer) {
+        av_free(r);
+        av_free(buffer);
+        close(fd);
+        return AVERROR(ENOMEM);
+    }
+    r->size = st.st_size;
+    r->fd = fd;
+    pthread_once(&bus_once, install_bus_handler);
+    r->map = map_acquire(fd, &st);
+    if (r->map) {
+        /* the mapping stays valid without the descriptor */
+        close(fd);
+        r->fd = -1;
+    }else {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#ifdef HAVE_LIBURING
+        r->ahead = av_malloc(MMAP_IO_BUFFER_SIZE);
+        if (r->ahead && io_uring_queue_init(4, &r->ring, 0) == 0)
+            r->ring_ready = 1;
+#endif
+    }
+
+    *pb = avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, r, read_packet, NULL, seek);
+    if (!*pb) {
+        av_free(buffer);
+        reader_free(r);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+void mmap_io_close(AVIOContext **pb) {
+    if (!pb || !*pb)
+        return;
+    reader_free((*pb)->opaque);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
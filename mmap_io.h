@@ -0,0 +1,13 @@
+#pragma once
+#ifndef _MMAP_IO_H_
+#define _MMAP_IO_H_
+
+#include <libavformat/avio.h>
+
+#define MMAP_IO_BUFFER_SIZE (256 * 1024)
+#define MMAP_IO_READAHEAD (8 * 1024 * 1024)
+
+int mmap_io_open(const char *filename, AVIOContext **pb);
+void mmap_io_close(AVIOContext **pb);
+
+#endif
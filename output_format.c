@@ -0,0 +1,33 @@
+#include <string.h>
+
+#include "output_format.h"
+
+/*
+ * Fragmented MP4 starts with an empty moov and one moof per keyframe, so it
+ * can be written to a pipe and the fragments are usable as CMAF segments for
+ * both HLS and DASH.
+ */
+static const OutputFormat output_formats[] = {
+    { "ts",   "mpegts", "video/mp2t", "ts",  NULL },
+    { "fmp4", "mp4",    "video/mp4",  "mp4", "movflags=frag_keyframe+empty_moov+default_base_moof" },
+    { "cmaf", "mp4",    "video/mp4",  "mp4", "movflags=frag_keyframe+empty_moov+default_base_moof" },
+    { NULL },
+};
+
+const OutputFormat *output_format_default()
+{
+    return &output_formats[0];
+}
+
+const OutputFormat *output_format_find(const char *name)
+{
+    int i;
+
+    if (name == NULL || name[0] == '\0')
+        return output_format_default();
+    for (i = 0; output_formats[i].name != NULL; i++) {
+        if (strcmp(output_formats[i].name, name) == 0)
+            return &output_formats[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#ifndef _OUTPUT_FORMAT_H_
+#define _OUTPUT_FORMAT_H_
+
+typedef struct OutputFormat {
+    const char *name;           /* value of the format= request option */
+    const char *muxer;          /* libavformat short name */
+    const char *content_type;
+    const char *extension;
+    const char *mux_options;    /* passed to avformat_write_header, "key=value:key=value" */
+} OutputFormat;
+
+const OutputFormat *output_format_default();
+const OutputFormat *output_format_find(const char *name);
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "prefork.h"
+#include "log.h"
+
+/*
+ * Warm transcoder processes. Each worker is forked once, with FFmpeg
+ * initialized, and then runs session after session: the server sends it a
+ * request over a socketpair with the write end of the session's output pipe
+ * attached (SCM_RIGHTS), and gets back an exit status once the output is
+ * complete. A crash takes down only that worker and its session; the worker
+ * is forked again for the next request.
+ *
+ * Workers are not forked by the server, whose other threads may hold locks
+ * (FFmpeg's codec lock among them) at that moment, but by a zygote: a
+ * single-threaded process forked in prefork_init, before any session runs.
+ * The server asks it for a worker and gets back the worker's pid and
+ * control socket. The zygote is the workers' parent, so it also reaps them,
+ * when told to, which keeps a worker's pid from being reused while the
+ * server may still signal it.
+ */
+typedef struct PreforkRequest {
+    char input[1024];
+    /* vcoder, acoder and output point into the program image, which the workers share */
+    EncodeParam param;
+} PreforkRequest;
+
+typedef struct PreforkReply {
+    int status;                 /* 0 = session completed */
+} PreforkReply;
+
+enum zygote_op_enum
+{
+    ZYGOTE_SPAWN = 0,           /* reply: a ZygoteMessage with the pid, and the control socket */
+    ZYGOTE_REAP,                /* wait for pid; no reply */
+};
+
+typedef struct ZygoteMessage {
+    int op;
+    pid_t pid;
+} ZygoteMessage;
+
+typedef struct PreforkWorker {
+    pid_t pid;
+    int control;                /* our end of the socketpair, -1 = not running */
+    int busy;
+    int sessions;
+} PreforkWorker;
+
+static PreforkWorker workers[PREFORK_MAX_WORKERS];
+static int nb_workers = 0;
+static int zygote = -1;             /* socket to the zygote, under workers_lock */
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a worker lives long: it must not keep other sessions' sockets and pipes open */
+static void close_inherited_fds(int keep)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+
+    if ((dir = opendir("/proc/self/fd")) == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        fd = atoi(entry->d_name);
+        if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir))
+            close(fd);
+    }
+    closedir(dir);
+}
+
+/** Receive one message of exactly size bytes, with a descriptor attached. */
+static int recv_with_fd(int sock, void *buf, size_t size, int *fd)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)size)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+static int send_with_fd(int sock, const void *buf, size_t size, int fd)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(cbuf, 0, sizeof(cbuf));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)size ? 0 : -1;
+}
+
+/* sessions log VmHWM as their peak RSS: start each from the worker's current RSS */
+static void reset_peak_rss()
+{
+    int fd;
+
+    if ((fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC)) < 0)
+        return;
+    if (write(fd, "5", 1) < 0)
+        DEBUG_LOG("cannot reset the peak RSS: %s\n", strerror(errno));
+    close(fd);
+}
+
+static void worker_main(int control)
+{
+    PreforkRequest request;
+    PreforkReply reply;
+    char output[32];
+    int fd, sessions = 0, ret;
+
+    close_inherited_fds(control);
+    /* a viewer leaving shows up as a failed write, not a dead worker */
+    signal(SIGPIPE, SIG_IGN);
+    av_log_set_level(AV_LOG_ERROR);
+    codec_pool_init(PREFORK_CODEC_POOL_SIZE);
+
+    while (recv_with_fd(control, &request, sizeof(request), &fd) == 0) {
+        snprintf(output, sizeof(output), "pipe:%d", fd);
+        reset_peak_rss();
+        ret = create_trans_task(request.input, output, &request.param);
+        /* the pipe protocol leaves the descriptor open: this is the reader's EOF */
+        close(fd);
+        reply.status = ret < 0 ? 1 : 0;
+        if (send(control, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+            break;
+        if (++sessions >= PREFORK_MAX_SESSIONS)
+            break;
+    }
+    _exit(0);
+}
+
+/* the zygote's loop: fork workers and reap them, on the server's request */
+static void zygote_main(int sock)
+{
+    ZygoteMessage message;
+    int sv[2];
+    pid_t pid;
+    ssize_t n;
+
+    close_inherited_fds(sock);
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+        do {
+            n = recv(sock, &message, sizeof(message), 0);
+        } while (n < 0 && errno == EINTR);
+        /* the server is gone */
+        if (n != sizeof(message))
+            break;
+        if (message.op == ZYGOTE_REAP) {
+            waitpid(message.pid, NULL, 0);
+            continue;
+        }
+        message.pid = -1;
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            send(sock, &message, sizeof(message), MSG_NOSIGNAL);
+            continue;
+        }
+        if ((pid = fork()) == 0) {
+            close(sock);
+            worker_main(sv[1]);
+        }
+        close(sv[1]);
+        message.pid = pid;
+        if (pid < 0)
+            send(sock, &message, sizeof(message), MSG_NOSIGNAL);
+        else if (send_with_fd(sock, &message, sizeof(message), sv[0]) < 0)
+            kill(pid, SIGTERM);
+        close(sv[0]);
+    }
+    _exit(0);
+}
+
+/* the caller holds workers_lock */
+static int spawn_worker(PreforkWorker *worker)
+{
+    ZygoteMessage message = { ZYGOTE_SPAWN, 0 };
+    int fd;
+
+    if (zygote < 0 || send(zygote, &message, sizeof(message), MSG_NOSIGNAL) != sizeof(message))
+        return -1;
+    /* a failed fork is answered without a descriptor */
+    if (recv_with_fd(zygote, &message, sizeof(message), &fd) < 0)
+        return -1;
+    worker->pid = message.pid;
+    worker->control = fd;
+    worker->busy = 0;
+    worker->sessions = 0;
+    return 0;
+}
+
+/* the caller holds workers_lock; the worker is between sessions or already dead */
+static void reap_worker(PreforkWorker *worker)
+{
+    ZygoteMessage message = { ZYGOTE_REAP, worker->pid };
+
+    if (worker->control < 0)
+        return;
+    close(worker->control);
+    worker->control = -1;
+    /* still unreaped, so the pid is still this worker's */
+    kill(worker->pid, SIGTERM);
+    if (zygote >= 0)
+        send(zygote, &message, sizeof(message), MSG_NOSIGNAL);
+}
+
+/**
+ * Start the zygote and fork the pool; call after init_ffmpeg() so every
+ * worker starts warm, and before sessions run in the server process.
+ */
+int prefork_init(int count)
+{
+    int sv[2];
+    pid_t pid;
+    int i;
+
+    if (count > PREFORK_MAX_WORKERS)
+        count = PREFORK_MAX_WORKERS;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    if ((pid = fork()) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }else if (pid == 0) {
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+
+    pthread_mutex_lock(&workers_lock);
+    zygote = sv[0];
+    for (i = 0; i < count; i++) {
+        workers[i].control = -1;
+        if (spawn_worker(&workers[i]) < 0) {
+            pthread_mutex_unlock(&workers_lock);
+            return -1;
+        }
+    }
+    nb_workers = count;
+    pthread_mutex_unlock(&workers_lock);
+    INFO_LOG("%d prefork workers started\n", count);
+    return 0;
+}
+
+/**
+ * Run a session on an idle worker. Returns the read end of its output, like
+ * spawn_trans_task, or < 0 when no worker is free.
+ */
+int prefork_start(const char *input, const EncodeParam *param, int *index)
+{
+    PreforkRequest request;
+    PreforkWorker *worker = NULL;
+    int pfds[2];
+    int i;
+
+    memset(&request, 0, sizeof(request));
+    if (snprintf(request.input, sizeof(request.input), "%s", input) >= (int)sizeof(request.input))
+        return -1;
+    request.param = *param;
+
+    pthread_mutex_lock(&workers_lock);
+    for (i = 0; i < nb_workers && worker == NULL; i++) {
+        if (workers[i].busy)
+            continue;
+        /* crashed or retired since its last session */
+        if (workers[i].control < 0 && spawn_worker(&workers[i]) < 0)
+            continue;
+        worker = &workers[i];
+        worker->busy = 1;
+    }
+    pthread_mutex_unlock(&workers_lock);
+    if (worker == NULL)
+        return -1;
+
+    if (pipe(pfds) < 0) {
+        pthread_mutex_lock(&workers_lock);
+        worker->busy = 0;
+        pthread_mutex_unlock(&workers_lock);
+        return -1;
+    }
+    if (send_with_fd(worker->control, &request, sizeof(request), pfds[1]) < 0) {
+        close(pfds[0]);
+        close(pfds[1]);
+        goto fail;
+    }
+    close(pfds[1]);
+    *index = worker - workers;
+    DEBUG_LOG("session on prefork worker %d (pid %d)\n", *index, (int)worker->pid);
+    return pfds[0];
+
+fail:
+    pthread_mutex_lock(&workers_lock);
+    reap_worker(worker);
+    worker->busy = 0;
+    pthread_mutex_unlock(&workers_lock);
+    return -1;
+}
+
+/**
+ * Wait for the session on a worker to end, after the output was read or
+ * closed. abort stops it first, at the cost of the worker. Returns 0 when
+ * the session completed.
+ */
+int prefork_finish(int index, int abort)
+{
+    PreforkWorker *worker = &workers[index];
+    PreforkReply reply;
+    ssize_t n;
+
+    if (abort)
+        kill(worker->pid, SIGTERM);
+    do {
+        n = recv(worker->control, &reply, sizeof(reply), 0);
+    } while (n < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&workers_lock);
+    if (abort) {
+        /* it may have replied before the signal landed: it is dying all the same */
+        reap_worker(worker);
+    }else if (n != sizeof(reply)) {
+        WARNING_LOG("prefork worker %d (pid %d) died during a session\n", index, (int)worker->pid);
+        reap_worker(worker);
+    }else if (++worker->sessions >= PREFORK_MAX_SESSIONS) {
+        reap_worker(worker);
+    }
+    worker->busy = 0;
+    pthread_mutex_unlock(&workers_lock);
+    return n == sizeof(reply) && reply.status == 0 ? 0 : -1;
+}
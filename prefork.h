@@ -0,0 +1,17 @@
+#pragma once
+#ifndef _PREFORK_H_
+#define _PREFORK_H_
+
+#include <sys/types.h>
+
+#include "ffmpeg.h"
+
+#define PREFORK_MAX_WORKERS 256
+#define PREFORK_MAX_SESSIONS 200        /* a worker is replaced after this many, against leaks */
+#define PREFORK_CODEC_POOL_SIZE 4       /* opened codecs a worker keeps between sessions */
+
+int prefork_init(int workers);
+int prefork_start(const char *input, const EncodeParam *param, int *worker);
+int prefork_finish(int worker, int abort);
+
+#endif
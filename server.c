@@ -1,80 +1,297 @@
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/sendfile.h>
 #include "server.h"
+#include "tls.h"
+#include "log.h"
 
 #define ISspace(x) isspace((int)(x))
 
 #define SERVER_STRING "Server: jdbhttpd/0.1.0\r\n"
 #define BLOCK_SIZE 4096
+#define LISTEN_FD_ENV "HTTPD_LISTEN_FD"
+#define MAX_CMDLINE 4096
+#define KEEPALIVE_MAX_REQUESTS 1000
+#define MAX_BODY_SIZE 65536
+
+extern char **environ;
+
+typedef struct Session {
+    int client;
+    struct Session *prev;
+    struct Session *next;
+} Session;
+
+static request_handler execute_cgi;
+static int listen_sock = -1;
+static int drain_timeout = 30;
+static int keepalive_timeout = 15;
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t restart_requested = 0;
+static volatile int draining = 0;
+static Session *sessions = NULL;
+static int active_sessions = 0;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t session_cond = PTHREAD_COND_INITIALIZER;
+
+static void session_end(Session *session)
+{
+    pthread_mutex_lock(&session_lock);
+    if (session->prev)
+        session->prev->next = session->next;
+    else
+        sessions = session->next;
+    if (session->next)
+        session->next->prev = session->prev;
+    active_sessions--;
+    pthread_cond_broadcast(&session_cond);
+    pthread_mutex_unlock(&session_lock);
+    free(session);
+}
 
-static void (*execute_cgi)(int client, const char *path, const char *method, const char *query_string);
-
-void accept_request(void *arg)
+/* case-insensitive search for token in a comma separated header value */
+static int header_has_token(const char *value, const char *token)
 {
-    int client = (intptr_t)arg;
-    char buf[BLOCK_SIZE];
-    size_t numchars;
-    char method[255];
-    char url[255];
-    char path[512];
-    size_t i, j;
-    struct stat st;
-    char *query_string = NULL;
+    size_t len = strlen(token);
 
-    numchars = get_line(client, buf, sizeof(buf));
-    i = 0; j = 0;
-    while (!ISspace(buf[i]) && (i < sizeof(method) - 1))
+    while (*value != '\0')
     {
-        method[i] = buf[i];
-        i++;
-    }
-    j=i;
-    method[i] = '\0';
-
-    if (!strcasecmp(method, "GET") == 0){
-        unimplemented(client);
-        return;
+        while (ISspace(*value) || *value == ',')
+            value++;
+        if (strncasecmp(value, token, len) == 0
+            && (value[len] == '\0' || value[len] == ',' || ISspace(value[len])))
+            return 1;
+        while (*value != '\0' && *value != ',')
+            value++;
     }
+    return 0;
+}
 
+/* the body is kept NUL terminated, so form bodies parse like query strings */
+static int read_body(int client, HttpRequest *request, size_t size)
+{
+    size_t done = 0;
+    ssize_t n;
 
-    i = 0;
-    while (ISspace(buf[j]) && (j < numchars))
-        j++;
-    while (!ISspace(buf[j]) && (i < sizeof(url) - 1) && (j < numchars))
+    request->body = malloc(size + 1);
+    if (request->body == NULL)
+        return -1;
+    while (done < size)
     {
-        url[i] = buf[j];
-        i++; j++;
+        n = tls_recv(client, request->body + done, size - done, 0);
+        if (n <= 0)
+        {
+            free(request->body);
+            request->body = NULL;
+            return -1;
+        }
+        done += n;
     }
-    url[i] = '\0';
+    request->body[size] = '\0';
+    request->body_length = size;
+    return 0;
+}
 
-    query_string = url;
-    while ((*query_string != '?') && (*query_string != '\0'))
-        query_string++;
-    if (*query_string == '?')
+/**
+ * Wait for the next request on a persistent connection. Gives up after the
+ * idle timeout, or early once the server starts draining.
+ */
+static int wait_next_request(int client)
+{
+    struct pollfd pfd;
+    int waited;
+
+    if (tls_pending(client))
+        return 1;
+    pfd.fd = client;
+    pfd.events = POLLIN;
+    for (waited = 0; waited < keepalive_timeout; waited++)
     {
-        *query_string = '\0';
-        query_string++;
+        if (stop_requested || draining)
+            return 0;
+        if (poll(&pfd, 1, 1000) > 0)
+            return 1;
     }
+    return 0;
+}
 
-    sprintf(path, file_path, url);
-    /*//判断文件是否存在
-    if (stat(path, &st) == -1) {
-        not_found(client);
-    }
-    */
+/**
+ * Connection loop. HTTP/1.1 connections stay open until the client asks to
+ * close, goes idle, or a response could not be framed. Pipelined requests
+ * simply wait in the socket buffer: get_line never reads past the request
+ * it is parsing, and each response is complete before the next one starts.
+ */
+void accept_request(void *arg)
+{
+    Session *session = arg;
+    int client = session->client;
+    char buf[BLOCK_SIZE];
+    size_t numchars;
+    HttpRequest request;
+    char *method = request.method;
+    char *url = request.url;
+    size_t i, j;
+    char *query_string = NULL;
+    int http11, connection_close, connection_keep_alive, chunked_body;
+    long long content_length;
+    int served = 0;
 
-    execute_cgi(client, path, method, query_string);
+    if (tls_accept(client) < 0)
+        goto end;
+    while (served == 0 || wait_next_request(client))
+    {
+        numchars = get_line(client, buf, sizeof(buf));
+        if (numchars == 0)
+            break;
+        i = 0; j = 0;
+        while (!ISspace(buf[i]) && (i < sizeof(request.method) - 1))
+        {
+            method[i] = buf[i];
+            i++;
+        }
+        j=i;
+        method[i] = '\0';
+
+        i = 0;
+        while (ISspace(buf[j]) && (j < numchars))
+            j++;
+        while (!ISspace(buf[j]) && (i < sizeof(request.url) - 1) && (j < numchars))
+        {
+            url[i] = buf[j];
+            i++; j++;
+        }
+        url[i] = '\0';
+        while (ISspace(buf[j]) && (j < numchars))
+            j++;
+        http11 = strncmp(buf + j, "HTTP/1.", 7) == 0 && buf[j + 7] >= '1' && buf[j + 7] <= '9';
+
+        query_string = url;
+        while ((*query_string != '?') && (*query_string != '\0'))
+            query_string++;
+        if (*query_string == '?')
+        {
+            *query_string = '\0';
+            query_string++;
+        }
+        request.query_string = query_string;
+
+        /* headers: only Range, Connection, X-Trace and the body framing are used, the rest is skipped */
+        request.range[0] = '\0';
+        request.trace = 0;
+        request.body = NULL;
+        request.body_length = 0;
+        connection_close = connection_keep_alive = chunked_body = 0;
+        content_length = 0;
+        while ((numchars = get_line(client, buf, sizeof(buf))) > 0 && strcmp("\n", buf))
+        {
+            buf[strcspn(buf, "\r\n")] = '\0';
+            if (strncasecmp(buf, "Range:", 6) == 0)
+            {
+                i = 6;
+                while (ISspace(buf[i]))
+                    i++;
+                snprintf(request.range, sizeof(request.range), "%s", buf + i);
+            }
+            else if (strncasecmp(buf, "Connection:", 11) == 0)
+            {
+                connection_close |= header_has_token(buf + 11, "close");
+                connection_keep_alive |= header_has_token(buf + 11, "keep-alive");
+            }
+            else if (strncasecmp(buf, "X-Trace:", 8) == 0)
+                request.trace = atoi(buf + 8) != 0;
+            else if (strncasecmp(buf, "Content-Length:", 15) == 0)
+                content_length = atoll(buf + 15);
+            else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0)
+                chunked_body = 1;
+        }
+        if (numchars == 0)
+            break;
 
+        if (strcasecmp(method, "GET") != 0 && strcasecmp(method, "POST") != 0)
+        {
+            /* a request body we do not read would be taken for the next request */
+            unimplemented(client);
+            break;
+        }
+        if (chunked_body || content_length < 0 || content_length > MAX_BODY_SIZE)
+        {
+            send_response(client, "413 Payload Too Large", "text/plain", NULL,
+                "request bodies need a Content-Length of at most 64 KiB\n");
+            break;
+        }
+        if (content_length > 0 && read_body(client, &request, content_length) < 0)
+            break;
+
+        /*
+         * HTTP/1.0 clients cannot parse chunked bodies, so they only stay
+         * connected for responses with a known length.
+         */
+        request.keep_alive = keepalive_timeout > 0 && !connection_close
+            && (http11 || connection_keep_alive)
+            && served + 1 < KEEPALIVE_MAX_REQUESTS && !stop_requested && !draining;
+        request.chunked = 0;
+        request.http11 = http11;
+
+        snprintf(request.path, sizeof(request.path), file_path, url);
+        execute_cgi(client, &request);
+        free(request.body);
+        served++;
+        if (!request.keep_alive)
+            break;
+    }
+    tls_close(client);
+
+end:
     close(client);
+    session_end(session);
+}
+
+/*
+ * Forked transcoders must not keep the listening socket open behind our
+ * back, and must still die on the SIGTERM their handler sends them.
+ */
+static void reset_forked_child(void)
+{
+    if (listen_sock >= 0)
+        close(listen_sock);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
 }
 
+/**
+ * Listening socket: inherited from the previous process on a hot restart,
+ * otherwise bound with SO_REUSEPORT so a new instance can overlap this one.
+ */
 int startup(u_short *port)
 {
     int httpd = 0;
     int on = 1;
     struct sockaddr_in name;
+    socklen_t namelen = sizeof(name);
+    const char *inherited = getenv(LISTEN_FD_ENV);
 
-    httpd = socket(PF_INET, SOCK_STREAM, 0);
+    if (inherited != NULL)
+    {
+        httpd = atoi(inherited);
+        unsetenv(LISTEN_FD_ENV);
+        if (getsockname(httpd, (struct sockaddr *)&name, &namelen) == 0 && name.sin_family == AF_INET)
+        {
+            fcntl(httpd, F_SETFD, FD_CLOEXEC);
+            *port = ntohs(name.sin_port);
+            return(httpd);
+        }
+        WARNING_LOG("ignoring invalid %s=%s\n", LISTEN_FD_ENV, inherited);
+    }
+
+    httpd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (httpd == -1)
         error_die("socket");
     memset(&name, 0, sizeof(name));
@@ -85,16 +302,19 @@ int startup(u_short *port)
     {  
         error_die("setsockopt failed");
     }
+#ifdef SO_REUSEPORT
+    if (setsockopt(httpd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        perror("SO_REUSEPORT");
+#endif
     if (bind(httpd, (struct sockaddr *)&name, sizeof(name)) < 0)
         error_die("bind");
     if (*port == 0)  /* if dynamically allocating a port */
     {
-        socklen_t namelen = sizeof(name);
         if (getsockname(httpd, (struct sockaddr *)&name, &namelen) == -1)
             error_die("getsockname");
         *port = ntohs(name.sin_port);
     }
-    if (listen(httpd, 5) < 0)
+    if (listen(httpd, SOMAXCONN) < 0)
         error_die("listen");
     return(httpd);
 }
@@ -105,22 +325,6 @@ void error_die(const char *sc)
     exit(1);
 }
 
-void bad_request(int client)
-{
-    char buf[1024];
-
-    sprintf(buf, "HTTP/1.0 400 BAD REQUEST\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "<P>Your browser sent a bad request, ");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "such as a POST without a Content-Length.\r\n");
-    send(client, buf, sizeof(buf), 0);
-}
-
 int get_line(int sock, char *buf, int size)
 {
     int i = 0;
@@ -129,16 +333,16 @@ int get_line(int sock, char *buf, int size)
 
     while ((i < size - 1) && (c != '\n'))
     {
-        n = recv(sock, &c, 1, 0);
+        n = tls_recv(sock, &c, 1, 0);
         /* DEBUG printf("%02X\n", c); */
         if (n > 0)
         {
             if (c == '\r')
             {
-                n = recv(sock, &c, 1, MSG_PEEK);
+                n = tls_recv(sock, &c, 1, MSG_PEEK);
                 /* DEBUG printf("%02X\n", c); */
                 if ((n > 0) && (c == '\n'))
-                    recv(sock, &c, 1, 0);
+                    tls_recv(sock, &c, 1, 0);
                 else
                     c = '\n';
             }
@@ -153,110 +357,491 @@ int get_line(int sock, char *buf, int size)
     return(i);
 }
 
-void write_ts_header(int client){
+/**
+ * Copy the value of name from a query string such as "a=1&b=2".
+ * Returns the value length, or -1 if the parameter is absent.
+ */
+int get_query_param(const char *query_string, const char *name, char *value, int size)
+{
+    const char *p = query_string;
+    size_t len = strlen(name);
+    int i;
+
+    if (p == NULL || size <= 0)
+        return -1;
+    while (*p != '\0')
+    {
+        if (strncmp(p, name, len) == 0 && (p[len] == '=' || p[len] == '&' || p[len] == '\0'))
+        {
+            p += len;
+            if (*p == '=')
+                p++;
+            i = 0;
+            while (*p != '\0' && *p != '&' && i < size - 1)
+                value[i++] = *p++;
+            value[i] = '\0';
+            return(i);
+        }
+        while (*p != '\0' && *p != '&')
+            p++;
+        if (*p == '&')
+            p++;
+    }
+    return(-1);
+}
+
+static int send_all(int client, const void *buf, size_t size, int flags)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (size > 0)
+    {
+        n = send(client, p, size, flags | MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static const char *connection_header(const HttpRequest *request)
+{
+    return request != NULL && request->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
+/**
+ * Header of a response whose length is not known up front. On a persistent
+ * HTTP/1.1 connection the body is chunked; otherwise it ends when the
+ * connection closes. request may be NULL for the latter.
+ */
+void write_stream_header(int client, HttpRequest *request, const char *content_type){
     char buf[1024];
-    sprintf(buf, "HTTP/1.1 200 OK\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: video/mp2t\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Accept-Ranges: bytes\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: video/mp2t\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Access-Control-Allow-Origin: *\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Connection: keep-alive\r\n");
-    send(client, buf, strlen(buf), 0);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
+
+    if (request != NULL)
+    {
+        request->keep_alive = request->keep_alive && request->http11;
+        request->chunked = request->keep_alive;
+    }
+    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "%s%s\r\n",
+        content_type, request != NULL && request->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+        connection_header(request));
+    send_all(client, buf, strlen(buf), 0);
 }
 
-void not_found(int client)
+void write_ts_header(int client){
+    write_stream_header(client, NULL, "video/mp2t");
+}
+
+static int send_chunk_header(int client, size_t size)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%zx\r\n", size);
+    return send_all(client, buf, strlen(buf), MSG_MORE);
+}
+
+/** Body data after write_stream_header(); a failed send ends keep-alive. */
+int send_body(int client, HttpRequest *request, const void *buf, size_t size)
+{
+    int ret;
+
+    if (size == 0)
+        return 0; /* an empty chunk would end the body */
+    if (request->chunked)
+        ret = send_chunk_header(client, size) < 0 || send_all(client, buf, size, MSG_MORE) < 0
+            || send_all(client, "\r\n", 2, 0) < 0 ? -1 : 0;
+    else
+        ret = send_all(client, buf, size, 0);
+    if (ret < 0)
+        request->keep_alive = 0;
+    return ret;
+}
+
+/** Like send_body, for size bytes of fd from *offset, which is advanced. */
+int sendfile_body(int client, HttpRequest *request, int fd, off_t *offset, size_t size)
+{
+    ssize_t n;
+
+    if (size == 0)
+        return 0;
+    if (request->chunked && send_chunk_header(client, size) < 0)
+        goto fail;
+    while (size > 0)
+    {
+        n = sendfile(client, fd, offset, size > (1 << 20) ? (1 << 20) : size);
+        if (n <= 0)
+            goto fail;
+        size -= n;
+    }
+    if (request->chunked && send_all(client, "\r\n", 2, 0) < 0)
+        goto fail;
+    return 0;
+fail:
+    request->keep_alive = 0;
+    return -1;
+}
+
+/** Terminate a complete body. Incomplete ones are left unterminated and the connection closes. */
+int end_body(int client, HttpRequest *request)
+{
+    if (request->chunked && send_all(client, "0\r\n\r\n", 5, 0) < 0)
+    {
+        request->keep_alive = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parse a "bytes=start-end" Range header against a file of the given size.
+ * Returns 0 for a valid range, 1 if there is no usable range (send the
+ * whole file) and -1 if the range cannot be satisfied.
+ */
+int parse_range(const char *range, int64_t size, int64_t *start, int64_t *end)
+{
+    char *p;
+    long long a = -1, b = -1;
+
+    *start = 0;
+    *end = size - 1;
+    if (range == NULL || strncmp(range, "bytes=", 6) != 0)
+        return 1;
+    range += 6;
+    if (strchr(range, ',') != NULL)
+        return 1; /* multipart ranges are answered with the full body */
+
+    if (*range == '-')
+    {
+        /* suffix range: last N bytes */
+        b = strtoll(range + 1, &p, 10);
+        if (p == range + 1 || b <= 0)
+            return -1;
+        *start = size > b ? size - b : 0;
+        return 0;
+    }
+    a = strtoll(range, &p, 10);
+    if (p == range || *p != '-')
+        return 1;
+    if (*(p + 1) != '\0')
+        b = strtoll(p + 1, NULL, 10);
+    if (a >= size || (b >= 0 && b < a))
+        return -1;
+    *start = a;
+    if (b >= 0 && b < size)
+        *end = b;
+    return 0;
+}
+
+/** Send a complete file with sendfile, honouring the request's Range header. */
+int serve_file(int client, HttpRequest *request, const char *path, const char *content_type)
 {
     char buf[1024];
+    struct stat st;
+    int64_t start, end;
+    off_t offset;
+    int fd, partial, ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        not_found(client);
+        return -1;
+    }
+
+    partial = parse_range(request->range, st.st_size, &start, &end);
+    if (partial < 0)
+    {
+        snprintf(buf, sizeof(buf), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n%s\r\n",
+            (long long)st.st_size, connection_header(request));
+        send_all(client, buf, strlen(buf), 0);
+        close(fd);
+        return -1;
+    }
 
-    sprintf(buf, "HTTP/1.0 404 NOT FOUND\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<HTML><TITLE>Not Found</TITLE>\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<BODY><P>The server could not fulfill\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "your request because the resource specified\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "is unavailable or nonexistent.\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</BODY></HTML>\r\n");
-    send(client, buf, strlen(buf), 0);
+    snprintf(buf, sizeof(buf), "%s"
+        "Content-Type: %s\r\n"
+        "Content-Length: %lld\r\n",
+        partial == 0 ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n",
+        content_type, (long long)(end - start + 1));
+    if (partial == 0)
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Range: bytes %lld-%lld/%lld\r\n",
+            (long long)start, (long long)end, (long long)st.st_size);
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Accept-Ranges: bytes\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "%s\r\n", connection_header(request));
+    /* MSG_MORE lets the header leave in the same segment as the first body bytes */
+    send_all(client, buf, strlen(buf), MSG_MORE);
+
+    /* Content-Length framing: sendfile_body must not chunk this */
+    request->chunked = 0;
+    offset = start;
+    ret = sendfile_body(client, request, fd, &offset, end - start + 1);
+    close(fd);
+
+    return ret;
 }
 
-void unimplemented(int client)
+/**
+ * A complete response with a Content-Length, so it does not cost the
+ * connection. headers, if given, are extra "Name: value\r\n" lines.
+ */
+void send_response(int client, const char *status, const char *content_type,
+    const char *headers, const char *body)
 {
     char buf[1024];
+    size_t size = strlen(body);
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\n"
+        SERVER_STRING
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s\r\n",
+        status, content_type, size, headers ? headers : "");
+    if (send_all(client, buf, strlen(buf), size > 0 ? MSG_MORE : 0) == 0)
+        send_all(client, body, size, 0);
+}
+
+static void send_error(int client, const char *status, const char *body)
+{
+    send_response(client, status, "text/html", NULL, body);
+}
 
-    sprintf(buf, "HTTP/1.0 501 Method Not Implemented\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<HTML><HEAD><TITLE>Method Not Implemented\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</TITLE></HEAD>\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<BODY><P>HTTP request method not supported.\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</BODY></HTML>\r\n");
-    send(client, buf, strlen(buf), 0);
+void bad_request(int client)
+{
+    send_error(client, "400 BAD REQUEST",
+        "<P>Your browser sent a bad request, "
+        "such as a POST without a Content-Length.\r\n");
+}
+
+void not_found(int client)
+{
+    send_error(client, "404 NOT FOUND",
+        "<HTML><TITLE>Not Found</TITLE>\r\n"
+        "<BODY><P>The server could not fulfill\r\n"
+        "your request because the resource specified\r\n"
+        "is unavailable or nonexistent.\r\n"
+        "</BODY></HTML>\r\n");
+}
+
+void unimplemented(int client)
+{
+    send_error(client, "501 Method Not Implemented",
+        "<HTML><HEAD><TITLE>Method Not Implemented\r\n"
+        "</TITLE></HEAD>\r\n"
+        "<BODY><P>HTTP request method not supported.\r\n"
+        "</BODY></HTML>\r\n");
 }
 
 void cannot_execute(int client)
 {
-    char buf[1024];
+    send_error(client, "500 Internal Server Error",
+        "<P>Error prohibited CGI execution.\r\n");
+}
+
+static void on_stop_signal(int sig)
+{
+    stop_requested = 1;
+}
+
+static void on_restart_signal(int sig)
+{
+    restart_requested = 1;
+}
+
+static void install_signal_handlers(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = on_restart_signal;
+    sigaction(SIGUSR2, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+}
+
+void set_drain_timeout(int seconds)
+{
+    drain_timeout = seconds;
+}
+
+/** Idle seconds before a persistent connection is closed, 0 disables keep-alive. */
+void set_keepalive_timeout(int seconds)
+{
+    keepalive_timeout = seconds;
+}
+
+/**
+ * Start a new copy of this program (same argv, re-read from /proc so an
+ * upgraded binary is picked up) that inherits the listening socket. Both
+ * processes share one accept queue, so no connection is refused meanwhile.
+ */
+static int hot_restart(int server_sock)
+{
+    char cmdline[MAX_CMDLINE], env[64];
+    char *argv[64], *envp[256];
+    pid_t pid;
+    ssize_t len;
+    int fd, i, n = 0, ret;
+
+    fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    len = read(fd, cmdline, sizeof(cmdline) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    cmdline[len] = '\0';
+    for (i = 0; i < len && n < 63; i += strlen(cmdline + i) + 1)
+        argv[n++] = cmdline + i;
+    argv[n] = NULL;
+
+    snprintf(env, sizeof(env), "%s=%d", LISTEN_FD_ENV, server_sock);
+    envp[0] = env;
+    for (i = 0, n = 1; environ[i] != NULL && n < 255; i++)
+    {
+        if (strncmp(environ[i], LISTEN_FD_ENV "=", strlen(LISTEN_FD_ENV) + 1) != 0)
+            envp[n++] = environ[i];
+    }
+    envp[n] = NULL;
+
+    /* posix_spawn skips the atfork handlers, so only the new process inherits it */
+    fcntl(server_sock, F_SETFD, 0);
+    ret = posix_spawnp(&pid, argv[0], NULL, NULL, argv, envp);
+    fcntl(server_sock, F_SETFD, FD_CLOEXEC);
+    if (ret != 0)
+    {
+        errno = ret;
+        return -1;
+    }
+    INFO_LOG("hot restart: started pid %d\n", (int)pid);
+    return 0;
+}
+
+/** Wait for in-flight sessions; past the deadline, cut their sockets so handlers unwind. */
+static void drain_sessions(void)
+{
+    struct timespec deadline;
+    Session *session;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_timeout;
 
-    sprintf(buf, "HTTP/1.0 500 Internal Server Error\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<P>Error prohibited CGI execution.\r\n");
-    send(client, buf, strlen(buf), 0);
+    pthread_mutex_lock(&session_lock);
+    INFO_LOG("draining %d session(s), up to %ds\n", active_sessions, drain_timeout);
+    while (active_sessions > 0)
+    {
+        if (pthread_cond_timedwait(&session_cond, &session_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    if (active_sessions > 0)
+    {
+        INFO_LOG("drain deadline reached, closing %d session(s)\n", active_sessions);
+        for (session = sessions; session != NULL; session = session->next)
+            shutdown(session->client, SHUT_RDWR);
+        deadline.tv_sec += 5;
+        while (active_sessions > 0)
+        {
+            if (pthread_cond_timedwait(&session_cond, &session_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+    }
+    pthread_mutex_unlock(&session_lock);
 }
 
-int run_server(u_short port, void (*handler)(int client, const char *path, const char *method, const char *query_string))
+/**
+ * Accept loop. SIGTERM/SIGINT stop accepting and drain the active sessions;
+ * SIGUSR2 hands the listening socket to a fresh process first.
+ */
+int run_server(u_short port, request_handler handler)
 {
 
     int server_sock = -1;
     int client_sock = -1;
     struct sockaddr_in client_name;
-    socklen_t  client_name_len = sizeof(client_name);
+    socklen_t  client_name_len;
+    struct pollfd pfd;
     pthread_t newthread;
+    Session *session;
 
+    install_signal_handlers();
     server_sock = startup(&port);
+    listen_sock = server_sock;
+    pthread_atfork(NULL, NULL, reset_forked_child);
     execute_cgi = handler;
-    printf("httpd running on port %d\n", port);
+    INFO_LOG("httpd running on port %d\n", port);
 
-    while (1)
+    while (!stop_requested)
     {
+        if (restart_requested)
+        {
+            restart_requested = 0;
+            if (hot_restart(server_sock) == 0)
+                break;
+            perror("hot restart");
+        }
+        pfd.fd = server_sock;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        client_name_len = sizeof(client_name);
         client_sock = accept(server_sock,
                 (struct sockaddr *)&client_name,
                 &client_name_len);
         if (client_sock == -1)
-            error_die("accept");
-        /* accept_request(&client_sock); */
-        if (pthread_create(&newthread , NULL, (void *)accept_request, (void *)(intptr_t)client_sock) != 0)
+        {
+            /* running out of descriptors is transient: back off instead of exiting */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                perror("accept");
+                usleep(100000);
+            }
+            else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                perror("accept");
+            continue;
+        }
+        fcntl(client_sock, F_SETFD, FD_CLOEXEC);
+        session = malloc(sizeof(*session));
+        if (session == NULL)
+        {
+            close(client_sock);
+            continue;
+        }
+        session->client = client_sock;
+        session->prev = NULL;
+        pthread_mutex_lock(&session_lock);
+        session->next = sessions;
+        if (sessions)
+            sessions->prev = session;
+        sessions = session;
+        active_sessions++;
+        pthread_mutex_unlock(&session_lock);
+        if (pthread_create(&newthread , NULL, (void *)accept_request, session) != 0)
+        {
             perror("pthread_create");
+            close(client_sock);
+            session_end(session);
+            continue;
+        }
+        pthread_detach(newthread);
     }
 
     close(server_sock);
+    listen_sock = -1;
+    draining = 1;
+    drain_sessions();
 
     return(0);
-}
\ No newline at end of file
+}
@@ -18,12 +18,41 @@
 
 extern char *file_path;
 
+typedef struct HttpRequest {
+    char method[255];
+    char url[255];
+    char path[512];
+    char *query_string;
+    char range[128];
+    char *body;             /* POST body, NUL terminated, NULL if none */
+    size_t body_length;
+    int http11;
+    int keep_alive;         /* connection stays open for the next request */
+    int chunked;            /* response body uses chunked transfer encoding */
+    int trace;              /* X-Trace: 1 */
+} HttpRequest;
+
+typedef void (*request_handler)(int client, HttpRequest *request);
+
 void accept_request(void *);
+void cannot_execute(int);
 void error_die(const char *);
 int get_line(int, char *, int);
+int get_query_param(const char *query_string, const char *name, char *value, int size);
 void not_found(int);
+int parse_range(const char *range, int64_t size, int64_t *start, int64_t *end);
+int serve_file(int client, HttpRequest *request, const char *path, const char *content_type);
+void send_response(int client, const char *status, const char *content_type,
+    const char *headers, const char *body);
+int send_body(int client, HttpRequest *request, const void *buf, size_t size);
+int sendfile_body(int client, HttpRequest *request, int fd, off_t *offset, size_t size);
+int end_body(int client, HttpRequest *request);
 int startup(u_short *);
 void unimplemented(int);
-int run_server(u_short port, void (*handler)(int client, const char *path, const char *method, const char *query_string));
+void write_stream_header(int, HttpRequest *, const char *);
+void write_ts_header(int);
+void set_drain_timeout(int seconds);
+void set_keepalive_timeout(int seconds);
+int run_server(u_short port, request_handler handler);
 
 #endif
\ No newline at end of file
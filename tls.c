@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#ifndef SSL_OP_ENABLE_KTLS
+#error "TLS=1 needs OpenSSL 3.0 or later"
+#endif
+#endif
+
+#include "tls.h"
+#include "log.h"
+
+/*
+ * OpenSSL only does the handshake. The record keys are then handed to the
+ * kernel (kTLS), so responses keep going out through send() and sendfile()
+ * on the plain socket and the kernel encrypts them. Requests are read
+ * through OpenSSL unless the kernel took over receiving as well.
+ */
+#ifdef HAVE_OPENSSL
+typedef struct TlsConn {
+    SSL *ssl;
+    int fd;
+    int ktls_recv;
+} TlsConn;
+
+static SSL_CTX *tls_ctx = NULL;
+/* each connection is served by its own thread from accept to close */
+static __thread TlsConn *thread_conn = NULL;
+
+static void log_ssl_errors(const char *what)
+{
+    char buf[256];
+    unsigned long e;
+
+    while ((e = ERR_get_error()) != 0) {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        ERROR_LOG("%s: %s\n", what, buf);
+    }
+}
+
+static TlsConn *find_conn(int fd)
+{
+    return thread_conn != NULL && thread_conn->fd == fd ? thread_conn : NULL;
+}
+#endif
+
+int tls_init(const char *cert_file, const char *key_file)
+{
+#ifdef HAVE_OPENSSL
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        log_ssl_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    /* only suites the kernel can offload */
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        log_ssl_errors(cert_file);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    tls_ctx = ctx;
+    return 0;
+#else
+    ERROR_LOG("built without TLS support, rebuild with make TLS=1\n");
+    return -1;
+#endif
+}
+
+int tls_enabled()
+{
+#ifdef HAVE_OPENSSL
+    return tls_ctx != NULL;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Server side handshake on an accepted socket. Connections whose keys the
+ * kernel cannot take for sending are refused, since everything after this
+ * writes to the socket directly. A no-op without tls_init().
+ */
+int tls_accept(int fd)
+{
+#ifdef HAVE_OPENSSL
+    struct timeval timeout = { TLS_HANDSHAKE_TIMEOUT, 0 }, none = { 0, 0 };
+    TlsConn *conn;
+    int ret;
+
+    if (tls_ctx == NULL)
+        return 0;
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+        return -1;
+    conn->fd = fd;
+    conn->ssl = SSL_new(tls_ctx);
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, fd) != 1) {
+        log_ssl_errors("SSL_new");
+        goto fail;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ret = SSL_accept(conn->ssl);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+    if (ret != 1) {
+        DEBUG_LOG("TLS handshake failed: %d\n", SSL_get_error(conn->ssl, ret));
+        log_ssl_errors("TLS handshake");
+        goto fail;
+    }
+    if (!BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) {
+        ERROR_LOG("no kernel TLS for %s %s, is the tls module loaded?\n",
+            SSL_get_version(conn->ssl), SSL_get_cipher_name(conn->ssl));
+        goto fail;
+    }
+    conn->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(conn->ssl));
+    DEBUG_LOG("TLS %s %s, kernel rx %d\n", SSL_get_version(conn->ssl),
+        SSL_get_cipher_name(conn->ssl), conn->ktls_recv);
+    thread_conn = conn;
+    return 0;
+
+fail:
+    SSL_free(conn->ssl);
+    free(conn);
+    return -1;
+#else
+    return 0;
+#endif
+}
+
+/** recv() for request data, decrypted in user space if the kernel only offloads sending. */
+ssize_t tls_recv(int fd, void *buf, size_t size, int flags)
+{
+#ifdef HAVE_OPENSSL
+    TlsConn *conn = find_conn(fd);
+    int n;
+
+    if (conn != NULL && !conn->ktls_recv) {
+        n = flags & MSG_PEEK ? SSL_peek(conn->ssl, buf, size) : SSL_read(conn->ssl, buf, size);
+        if (n > 0)
+            return n;
+        return SSL_get_error(conn->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+#endif
+    return recv(fd, buf, size, flags);
+}
+
+/* decrypted bytes OpenSSL holds that poll() on the socket cannot see */
+int tls_pending(int fd)
+{
+#ifdef HAVE_OPENSSL
+    TlsConn *conn = find_conn(fd);
+
+    return conn != NULL && !conn->ktls_recv && SSL_pending(conn->ssl) > 0;
+#else
+    return 0;
+#endif
+}
+
+/** Send close_notify and free the session; the caller still closes fd. */
+void tls_close(int fd)
+{
+#ifdef HAVE_OPENSSL
+    TlsConn *conn = find_conn(fd);
+
+    if (conn == NULL)
+        return;
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    free(conn);
+    thread_conn = NULL;
+#endif
+}
@@ -0,0 +1,16 @@
+#pragma once
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+
+#define TLS_HANDSHAKE_TIMEOUT 10    /* seconds */
+
+int tls_init(const char *cert_file, const char *key_file);
+int tls_enabled();
+int tls_accept(int fd);
+ssize_t tls_recv(int fd, void *buf, size_t size, int flags);
+int tls_pending(int fd);
+void tls_close(int fd);
+
+#endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/*
+ * Session timelines. Like the log rings, each thread records into its own
+ * ring, so tracing takes no lock; unlike them, a trace is written by the
+ * thread that recorded it, when its session ends, as Chrome trace JSON
+ * (chrome://tracing, ui.perfetto.dev).
+ */
+typedef struct TraceEvent {
+    const char *name;           /* a string literal */
+    int stream;                 /* input stream, -1 = none */
+    int64_t begin;              /* nanoseconds, CLOCK_MONOTONIC */
+    int64_t end;
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_SIZE];
+    unsigned int head;          /* events recorded, including overwritten ones */
+    int64_t origin;             /* trace_start(), the timeline's zero */
+} TraceRing;
+
+__thread int trace_active = 0;
+static __thread TraceRing *thread_ring;
+static const char *trace_dir = NULL;
+
+/**
+ * Where sessions write their traces. Process wide; set before starting
+ * sessions. Without it, requests asking for a trace are not traced.
+ */
+void trace_set_dir(const char *dir)
+{
+    trace_dir = dir;
+}
+
+const char *trace_get_dir()
+{
+    return trace_dir;
+}
+
+int trace_enabled()
+{
+    return trace_dir != NULL;
+}
+
+int64_t trace_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_event(const char *name, int stream, int64_t begin)
+{
+    TraceRing *ring = thread_ring;
+    TraceEvent *event;
+
+    if (ring == NULL)
+        return;
+    event = &ring->events[ring->head++ & (TRACE_RING_SIZE - 1)];
+    event->name = name;
+    event->stream = stream;
+    event->begin = begin;
+    event->end = trace_now();
+}
+
+/** Start recording on the calling thread. */
+int trace_start()
+{
+    if (thread_ring == NULL && (thread_ring = malloc(sizeof(*thread_ring))) == NULL)
+        return -ENOMEM;
+    thread_ring->head = 0;
+    thread_ring->origin = trace_now();
+    trace_active = 1;
+    return 0;
+}
+
+static void json_string(FILE *out, const char *src)
+{
+    fputc('"', out);
+    for (; *src != '\0'; src++) {
+        if (*src == '"' || *src == '\\')
+            fprintf(out, "\\%c", *src);
+        else if ((unsigned char)*src < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char)*src);
+        else
+            fputc(*src, out);
+    }
+    fputc('"', out);
+}
+
+/* keep the newest TRACE_MAX_FILES traces of the directory */
+static void prune_traces()
+{
+    char path[1024], oldest[1024];
+    struct dirent *de;
+    struct stat st;
+    time_t oldest_time;
+    int count;
+    DIR *dir;
+
+    do {
+        if ((dir = opendir(trace_dir)) == NULL)
+            return;
+        count = 0;
+        oldest[0] = '\0';
+        oldest_time = 0;
+        while ((de = readdir(dir)) != NULL) {
+            if (strncmp(de->d_name, "trace-", 6) != 0 || strstr(de->d_name, ".json") == NULL)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", trace_dir, de->d_name);
+            if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+                continue;
+            count++;
+            if (oldest[0] == '\0' || st.st_mtime < oldest_time) {
+                snprintf(oldest, sizeof(oldest), "%s", path);
+                oldest_time = st.st_mtime;
+            }
+        }
+        closedir(dir);
+    } while (count > TRACE_MAX_FILES && unlink(oldest) == 0);
+}
+
+/**
+ * Stop recording on the calling thread and write what the ring holds to
+ * path, as complete ("X") events in microseconds since trace_start().
+ * label names the thread in the viewer. Returns the number of events
+ * written, < 0 on error.
+ */
+int trace_stop(const char *path, const char *label)
+{
+    TraceRing *ring = thread_ring;
+    const TraceEvent *event;
+    unsigned int i, first;
+    int pid = getpid(), tid = syscall(SYS_gettid);
+    FILE *out;
+    int ret;
+
+    trace_active = 0;
+    if (ring == NULL)
+        return -1;
+    thread_ring = NULL;
+    if ((out = fopen(path, "w")) == NULL) {
+        ret = -errno;
+        goto end;
+    }
+
+    first = ring->head > TRACE_RING_SIZE ? ring->head - TRACE_RING_SIZE : 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"overwritten\":%u},\"traceEvents\":[\n", first);
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, tid);
+    json_string(out, label);
+    fprintf(out, "}}");
+    for (i = first; i != ring->head; i++) {
+        event = &ring->events[i & (TRACE_RING_SIZE - 1)];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"session\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+            event->name, (event->begin - ring->origin) / 1000.0, (event->end - event->begin) / 1000.0, pid, tid);
+        if (event->stream >= 0)
+            fprintf(out, ",\"args\":{\"stream\":%d}", event->stream);
+        fputc('}', out);
+    }
+    fprintf(out, "\n]}\n");
+    ret = fclose(out) == 0 ? (int)(ring->head - first) : -errno;
+    if (trace_dir != NULL)
+        prune_traces();
+
+end:
+    free(ring);
+    return ret;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_RING_SIZE 65536       /* events per thread, power of two; the oldest are overwritten */
+#define TRACE_MAX_FILES 64          /* traces kept in the trace directory; the oldest are removed */
+
+extern __thread int trace_active;
+
+/*
+ * Time one pipeline call on the calling thread:
+ *
+ *     t = TRACE_BEGIN();
+ *     ret = av_read_frame(ifmt_ctx, &packet);
+ *     TRACE_END("read", packet.stream_index, t);
+ *
+ * Both are a thread-local test when the thread is not tracing.
+ */
+#define TRACE_BEGIN() (trace_active ? trace_now() : 0)
+#define TRACE_END(name, stream, begin) do { \
+    if (begin) \
+        trace_event(name, stream, begin); \
+} while (0)
+
+void trace_set_dir(const char *dir);
+const char *trace_get_dir();
+int trace_enabled();
+int64_t trace_now();
+void trace_event(const char *name, int stream, int64_t begin);
+int trace_start();
+int trace_stop(const char *path, const char *label);
+
+#endif